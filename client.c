@@ -25,6 +25,7 @@
 #include <sys/timerfd.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
@@ -52,6 +53,11 @@
 
 #include "protocol.h"
 
+/* the transport needs to call the real syscall() */
+static long (*_syscall)(long number, ...);
+#define FUTEX_SYSCALL _syscall
+#include "transport.h"
+
 #include "client_fuzz.c"
 
 /* first node in first subnet is 192.168.123.1 */
@@ -100,6 +106,9 @@ static void *(*_shmat)(int shmid, const void *shmaddr, int shmflg);
 static unsigned int node;
 static int initialized = 0;
 static int clknetsim_fd;
+static int shm_fds[2];
+static int num_shm_fds = 0;
+static struct Transport_shm *transport = NULL;
 static int precision_hack = 1;
 static unsigned int random_seed = 0;
 static int recv_multiply = 1;
@@ -140,6 +149,12 @@ static double real_time = 0.0;
 static double monotonic_time = 0.0;
 static double network_time = 0.0;
 static int local_time_valid = 0;
+static const struct Time_page *time_page = NULL;
+static int time_page_current = 0;
+
+/* packet returned in the select reply which was not read yet */
+static struct Reply_recv select_packet;
+static int select_packet_ret = -1;
 
 static time_t system_time_offset = 1262304000; /* 2010-01-01 0:00 UTC */
 
@@ -192,6 +207,7 @@ static void init(void) {
 	struct sockaddr_un s = {AF_UNIX, "clknetsim.sock"};
 	const char *env;
 	unsigned int connect_retries = 100; /* 10 seconds */
+	int i;
 
 	if (initialized)
 		return;
@@ -210,6 +226,7 @@ static void init(void) {
 	_srandom = (void (*)(unsigned int seed))dlsym(RTLD_NEXT, "srandom");
 	_shmget = (int (*)(key_t key, size_t size, int shmflg))dlsym(RTLD_NEXT, "shmget");
 	_shmat = (void *(*)(int shmid, const void *shmaddr, int shmflg))dlsym(RTLD_NEXT, "shmat");
+	_syscall = (long (*)(long number, ...))dlsym(RTLD_NEXT, "syscall");
 
 	env = getenv("CLKNETSIM_START_DATE");
 	if (env)
@@ -267,9 +284,30 @@ static void init(void) {
 	initialized = 1;
 
 	req.node = node;
+	req.transport = TRANSPORT_SHM;
 	make_request(REQ_REGISTER, &req, sizeof (req), &rep, sizeof (rep));
 
 	subnets = rep.subnets;
+
+	/* the server may pass shared memory to be used for following requests
+	   and a page with the current time */
+	i = 0;
+	if (rep.transport == TRANSPORT_SHM) {
+		assert(i < num_shm_fds);
+		transport = (struct Transport_shm *)mmap(NULL, sizeof (*transport),
+				PROT_READ | PROT_WRITE, MAP_SHARED, shm_fds[i++], 0);
+		assert(transport != MAP_FAILED);
+	}
+	if (rep.time_page) {
+		assert(i < num_shm_fds);
+		time_page = (const struct Time_page *)mmap(NULL, sizeof (*time_page),
+				PROT_READ, MAP_SHARED, shm_fds[i++], 0);
+		assert(time_page != MAP_FAILED);
+		time_page_current = 1;
+	}
+	for (i = 0; i < num_shm_fds; i++)
+		_close(shm_fds[i]);
+	num_shm_fds = 0;
 }
 
 __attribute__((destructor))
@@ -278,6 +316,51 @@ static void fini(void) {
 		make_request(REQ_DEREGISTER, NULL, 0, NULL, 0);
 }
 
+static int receive_reply(void *reply, int replylen) {
+	char cmsgbuf[CMSG_SPACE(sizeof (shm_fds))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int received;
+
+	iov.iov_base = reply;
+	iov.iov_len = replylen;
+	memset(&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof (cmsgbuf);
+
+	received = _recvmsg(clknetsim_fd, &msg, 0);
+
+	cmsg = received > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		num_shm_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+		assert(num_shm_fds <= 2);
+		memcpy(shm_fds, CMSG_DATA(cmsg), num_shm_fds * sizeof (int));
+	}
+
+	return received;
+}
+
+static void check_server_connection(void) {
+	struct msghdr msg;
+	struct iovec iov;
+	char c;
+
+	iov.iov_base = &c;
+	iov.iov_len = sizeof (c);
+	memset(&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (_recvmsg(clknetsim_fd, &msg, MSG_PEEK | MSG_DONTWAIT) == 0) {
+		fprintf(stderr, "clknetsim: server connection closed.\n");
+		initialized = 0;
+		exit(1);
+	}
+}
+
 static void make_request(int request_id, const void *request_data, int reqlen, void *reply, int replylen) {
 	struct Request_packet request;
 	int sent, received = 0;
@@ -298,8 +381,15 @@ static void make_request(int request_id, const void *request_data, int reqlen, v
 		memcpy(&request.data, request_data, reqlen);
 	reqlen += offsetof(struct Request_packet, data);
 
-	if ((sent = _send(clknetsim_fd, &request, reqlen, 0)) <= 0 ||
-			(reply && (received = recv(clknetsim_fd, reply, replylen, 0)) <= 0)) {
+	if (transport) {
+		while (!transport_write(&transport->requests, &request, reqlen, 1000))
+			check_server_connection();
+		sent = reqlen;
+		while (reply && (received = transport_read(&transport->replies,
+						reply, replylen, 1000)) < 0)
+			check_server_connection();
+	} else if ((sent = _send(clknetsim_fd, &request, reqlen, 0)) <= 0 ||
+			(reply && (received = receive_reply(reply, replylen)) <= 0)) {
 		fprintf(stderr, "clknetsim: server connection closed.\n");
 		initialized = 0;
 		exit(1);
@@ -310,6 +400,9 @@ static void make_request(int request_id, const void *request_data, int reqlen, v
 	if (!reply)
 		return;
 
+	/* the server has processed all previous requests */
+	time_page_current = 1;
+
 	/* check reply length */
 	switch (request_id) {
 		case REQ_RECV:
@@ -318,16 +411,39 @@ static void make_request(int request_id, const void *request_data, int reqlen, v
 			assert(offsetof(struct Reply_recv, data) +
 				((struct Reply_recv *)reply)->len <= received);
 			break;
+		case REQ_SELECT:
+			/* reply with optional packet */
+			assert(received == offsetof(struct Reply_select, packet) ||
+				(received >= offsetof(struct Reply_select, packet.data) &&
+				 offsetof(struct Reply_select, packet.data) +
+				 ((struct Reply_select *)reply)->packet.len <= received));
+			break;
 		default:
 			assert(received == replylen);
 	}
 }
 
+static void read_time_page(struct Reply_gettime *r) {
+	unsigned int seq;
+
+	do {
+		while ((seq = __atomic_load_n(&time_page->sequence, __ATOMIC_ACQUIRE)) & 1)
+			;
+		r->real_time = time_page->real_time;
+		r->monotonic_time = time_page->monotonic_time;
+		r->network_time = time_page->network_time;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&time_page->sequence, __ATOMIC_RELAXED) != seq);
+}
+
 static void fetch_time(void) {
 	struct Reply_gettime r;
 
 	if (!local_time_valid) {
-		make_request(REQ_GETTIME, NULL, 0, &r, sizeof (r));
+		if (time_page && time_page_current)
+			read_time_page(&r);
+		else
+			make_request(REQ_GETTIME, NULL, 0, &r, sizeof (r));
 		real_time = r.real_time;
 		monotonic_time = r.monotonic_time;
 		network_time = r.network_time;
@@ -364,7 +480,9 @@ static void settime(double time) {
 	req.time = time;
 	make_request(REQ_SETTIME, &req, sizeof (req), NULL, 0);
 
+	/* the request has no reply, the page may not be updated yet */
 	local_time_valid = 0;
+	time_page_current = 0;
 }
 
 static void fill_refclock_sample(void) {
@@ -485,6 +603,28 @@ static int find_recv_socket(int subnet, int port, int broadcast) {
 	return s;
 }
 
+/* let the server drop packets which no socket could receive */
+static void send_ports(void) {
+	struct Request_setports req;
+	int i;
+
+	assert(MAX_SOCKETS <= REQUEST_SETPORTS_SIZE);
+
+	memset(&req, 0, sizeof (req));
+
+	for (i = 0; i < MAX_SOCKETS; i++) {
+		if (!sockets[i].used || sockets[i].type != SOCK_DGRAM ||
+				sockets[i].iface == IFACE_LO)
+			continue;
+		req.ports[req.num] = sockets[i].port;
+		req.subnets[req.num] = sockets[i].iface >= IFACE_ETH0 ?
+			sockets[i].iface - IFACE_ETH0 : -1;
+		req.num++;
+	}
+
+	make_request(REQ_SETPORTS, &req, sizeof (req), NULL, 0);
+}
+
 static int get_free_timer(void) {
 	int i;
 
@@ -740,7 +880,7 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struc
 	}
 
 	req.read = 0;
-	req._pad = 0;
+	req.packet = !fuzz_mode;
 
 	/* unknown reading fds are always ready (e.g. chronyd waiting
 	   for name resolving notification, or OpenSSL waiting for
@@ -775,6 +915,11 @@ try_again:
 	if (timer >= 0 && timers[timer].timeout <= monotonic_time) {
 		/* avoid unnecessary requests */
 		rep.ret = REPLY_SELECT_TIMEOUT;
+	} else if (req.read && select_packet_ret >= 0) {
+		/* packet from the previous select was not read yet */
+		rep.ret = select_packet_ret;
+		rep.subnet = select_packet.subnet;
+		rep.dst_port = select_packet.dst_port;
 	} else {
 		if (timer >= 0 && monotonic_time + req.timeout > timers[timer].timeout)
 			req.timeout = timers[timer].timeout - monotonic_time;
@@ -793,6 +938,13 @@ try_again:
 
 		if (monotonic_time >= 0.1 || timer >= 0 || rep.ret != REPLY_SELECT_TIMEOUT)
 			precision_hack = 0;
+
+		if (req.packet && (rep.ret == REPLY_SELECT_NORMAL ||
+					rep.ret == REPLY_SELECT_BROADCAST)) {
+			memcpy(&select_packet, &rep.packet,
+					offsetof(struct Reply_recv, data) + rep.packet.len);
+			select_packet_ret = rep.ret;
+		}
 	}
 
 	switch (rep.ret) {
@@ -827,14 +979,20 @@ try_again:
 
 			/* fetch and drop the packet if no fd is waiting for it */
 			if (!readfds || !recv_fd || !FD_ISSET(recv_fd, readfds)) {
-				struct Reply_recv recv_rep;
-
-				make_request(REQ_RECV, NULL, 0, &recv_rep, sizeof (recv_rep));
+				struct Reply_recv recv_rep, *packet;
+
+				if (select_packet_ret >= 0) {
+					packet = &select_packet;
+					select_packet_ret = -1;
+				} else {
+					make_request(REQ_RECV, NULL, 0, &recv_rep, sizeof (recv_rep));
+					packet = &recv_rep;
+				}
 				if (rep.ret != REPLY_SELECT_BROADCAST)
 					fprintf(stderr, "clknetsim: dropped packet from "
 							"node %d on port %d in subnet %d\n",
-							recv_rep.from + 1, recv_rep.dst_port,
-							recv_rep.subnet + 1);
+							packet->from + 1, packet->dst_port,
+							packet->subnet + 1);
 
 				goto try_again;
 			}
@@ -1037,6 +1195,7 @@ int close(int fd) {
 		return timer_delete(get_timerid(t));
 	} else if ((s = get_socket_from_fd(fd)) >= 0) {
 		sockets[s].used = 0;
+		send_ports();
 		return 0;
 	}
 
@@ -1064,6 +1223,8 @@ int socket(int domain, int type, int protocol) {
 	sockets[s].port = BASE_SOCKET_DEFAULT_PORT + s;
 	sockets[s].remote_node = -1;
 
+	send_ports();
+
 	return get_socket_fd(s);
 }
 
@@ -1088,6 +1249,8 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 	sockets[s].remote_node = node;
 	sockets[s].remote_port = port;
 
+	send_ports();
+
 	return 0;
 }
 
@@ -1122,6 +1285,8 @@ int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 			assert(0);
 	}
 
+	send_ports();
+
 	return 0;
 }
 
@@ -1178,6 +1343,7 @@ int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t
 			errno = EINVAL;
 			return -1;
 		}
+		send_ports();
 	}
 	else if (level == IPPROTO_IP && optname == IP_PKTINFO && optlen == sizeof (int))
 		sockets[s].pkt_info = !!(int *)optval;
@@ -1547,6 +1713,9 @@ ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
 		rep.len = 42 + last_ts_msg->len;
 
 		last_ts_msg->len = 0;
+	} else if (select_packet_ret >= 0) {
+		memcpy(&rep, &select_packet, offsetof(struct Reply_recv, data) + select_packet.len);
+		select_packet_ret = -1;
 	} else
 		make_request(REQ_RECV, NULL, 0, &rep, sizeof (rep));
 
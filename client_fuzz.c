@@ -227,6 +227,7 @@ static void fuzz_process_reply(int request_id, const union Request_data *request
 		case REQ_GETREFSAMPLE:
 		case REQ_GETREFOFFSETS:
 		case REQ_DEREGISTER:
+		case REQ_SETPORTS:
 			break;
 		case REQ_ADJTIMEX:
 			reply->adjtimex.timex.tick = 10000;
@@ -17,6 +17,8 @@
 
 #include "clock.h"
 
+#include <algorithm>
+
 #define MINSEC 256
 #define MAXSEC 2048
 #define MAXTIMECONST 10
@@ -31,14 +33,11 @@
 #define MIN_FREQ 0.8
 #define MAX_FREQ 1.2
 
-Clock::Clock() {
-	time = 0.0;
-	mono_time = 0.0;
+Clock::Clock(Clock_bank *bank, unsigned int index) {
+	this->bank = bank;
+	bank_index = index;
 	freq = 1.0;
 
-	freq_generator = NULL;
-	step_generator = NULL;
-
 	base_tick = sysconf(_SC_CLK_TCK);
 	assert(base_tick > 0);
 	base_tick = (1000000 + base_tick / 2) / base_tick;
@@ -59,36 +58,27 @@ Clock::Clock() {
 
 	ss_offset = 0;
 	ss_slew = 0;
+
+	rebase();
 }
 
 Clock::~Clock() {
-	if (freq_generator)
-		delete freq_generator;
-	if (step_generator)
-		delete step_generator;
 }
 
-double Clock::get_real_time() const {
-	return time;
+Sim_time Clock::get_real_time() const {
+	return bank->get_time(bank_index);
 }
 
-double Clock::get_monotonic_time() const {
-	return mono_time;
+Sim_time Clock::get_monotonic_time() const {
+	return bank->get_monotonic_time(bank_index);
 }
 
 double Clock::get_total_freq() const {
-	double timex_freq, adjtime_freq;
-
-	timex_freq = (double)ntp_timex.tick / base_tick + ntp_timex.freq / SCALE_FREQ + ntp_slew;
-	adjtime_freq = ss_slew / 1e6;
-	return freq * (timex_freq + adjtime_freq);
+	return bank->get_total_freq(bank_index);
 }
 
 double Clock::get_raw_freq() const {
-	double timex_freq;
-
-	timex_freq = (double)ntp_timex.tick / base_tick + ntp_timex.freq / SCALE_FREQ;
-	return freq * timex_freq;
+	return bank->get_raw_freq(bank_index);
 }
 
 double Clock::get_true_interval(double local_interval) const {
@@ -99,16 +89,84 @@ double Clock::get_local_interval(double true_interval) const {
 	return true_interval * get_total_freq();
 }
 
+/* Local interval in the given number of whole seconds following an update
+   of the clock, assuming the clock is updated every second and nothing else
+   changes it. The offset of the PLL decays geometrically and the adjtime()
+   offset is slewed at the maximum rate. */
+double Clock::get_local_interval_updates(double updates) const {
+	double raw_freq, ntp, ss;
+
+	raw_freq = (double)ntp_timex.tick / base_tick + ntp_timex.freq / SCALE_FREQ;
+
+	if (ntp_timex.status & STA_PLL)
+		ntp = ntp_offset * (1.0 - pow(1.0 - 1.0 / (1 << (ntp_shift_pll +
+						ntp_timex.constant)), updates));
+	else
+		ntp = ntp_slew * updates;
+
+	ss = updates * MAX_SLEWRATE;
+	if (ss > labs(ss_offset))
+		ss = labs(ss_offset);
+	if (ss_offset < 0)
+		ss = -ss;
+
+	return freq * (raw_freq * updates + ntp + ss / 1e6);
+}
+
+/* Get the true interval in which the clock advances by the local interval
+   if it's updated in the update interval and then every second. */
+double Clock::get_true_interval_updates(double local_interval, double update_interval) const {
+	double total_freq = get_total_freq(), lo, hi, mid, l;
+
+	if (local_interval <= total_freq * update_interval)
+		return local_interval / total_freq;
+
+	local_interval -= total_freq * update_interval;
+
+	/* find the second in which the interval ends */
+	for (lo = 0.0, hi = 1.0; get_local_interval_updates(hi) < local_interval; hi *= 2.0) {
+		lo = hi;
+		if (hi > 1e15)
+			return 1e20;
+	}
+
+	while (hi - lo > 1.0) {
+		mid = floor((lo + hi) / 2.0);
+		if (get_local_interval_updates(mid) < local_interval)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	l = get_local_interval_updates(lo);
+
+	return update_interval + lo + (local_interval - l) /
+		(get_local_interval_updates(hi) - l);
+}
+
+/* the updates can be batched if they don't need generators and the clock
+   is not inserting or deleting a leap second */
+bool Clock::can_batch_updates() const {
+	return !freq_generator.has_generator() && !step_generator.has_generator() &&
+		ntp_state == TIME_OK && !(ntp_timex.status & (STA_INS | STA_DEL));
+}
+
+/* the update has no effect on the clock if it doesn't have any generators,
+   the PLL is disabled, adjtime() is not slewing and there is no leap second */
+bool Clock::needs_update(bool second) const {
+	if (freq_generator.has_generator() || step_generator.has_generator())
+		return true;
+
+	return second && (ntp_timex.status & (STA_PLL | STA_INS | STA_DEL) ||
+			ss_offset || ss_slew || ntp_state != TIME_OK);
+}
+
 void Clock::set_freq_generator(Generator *gen) {
-	if (freq_generator)
-		delete freq_generator;
-	freq_generator = gen;
+	freq_generator.set_generator(gen);
 }
 
 void Clock::set_step_generator(Generator *gen) {
-	if (step_generator)
-		delete step_generator;
-	step_generator = gen;
+	step_generator.set_generator(gen);
 }
 
 void Clock::set_freq(double freq) {
@@ -117,14 +175,17 @@ void Clock::set_freq(double freq) {
 		fprintf(stderr, "frequency %e outside allowed range (%.2f, %.2f)\n", this->freq - 1.0, MIN_FREQ - 1.0, MAX_FREQ - 1.0);
 		exit(1);
 	}
+	rebase();
 }
 
-void Clock::set_time(double time) {
-	this->time = time;
+void Clock::set_time(Sim_time time) {
+	bank->set_time(bank_index, time);
+	rebase();
 }
 
 void Clock::step_time(double step) {
-	this->time += step;
+	bank->set_time(bank_index, get_real_time() + step);
+	rebase();
 }
 
 void Clock::set_ntp_shift_pll(int shift) {
@@ -137,18 +198,25 @@ void Clock::set_ntp_flag(int enable, int flag) {
 		ntp_flags |= flag;
 }
 
-void Clock::advance(double real_interval) {
-	double local_interval = get_local_interval(real_interval); 
+void Clock::advance(Sim_time network_time) {
+	bank->advance(bank_index, network_time);
+}
 
-	time += local_interval;
-	mono_time += local_interval;
+/* the frequency can be changed only when the clock is rebased */
+void Clock::rebase() {
+	double timex_freq, adjtime_freq;
+
+	timex_freq = (double)ntp_timex.tick / base_tick + ntp_timex.freq / SCALE_FREQ;
+	adjtime_freq = ss_slew / 1e6;
+	bank->rebase(bank_index, freq * (timex_freq + ntp_slew + adjtime_freq),
+			freq * timex_freq);
 }
 
 void Clock::update(bool second) {
-	if (freq_generator)
-		set_freq(freq_generator->generate(NULL));
-	if (step_generator)
-		step_time(step_generator->generate(NULL));
+	if (freq_generator.has_generator())
+		set_freq(freq_generator.next());
+	if (step_generator.has_generator())
+		step_time(step_generator.next());
 	
 	if (!second)
 		return;
@@ -202,8 +270,8 @@ void Clock::update(bool second) {
 				ntp_state = TIME_DEL;
 			break;
 		case TIME_INS:
-			if ((time_t)(time + 0.5) % (24 * 3600) <= 1) {
-				time -= 1.0;
+			if ((time_t)(get_real_time() + 0.5) % (24 * 3600) <= 1) {
+				bank->set_time(bank_index, get_real_time() - 1.0);
 				ntp_timex.tai += 1.0;
 				ntp_state = TIME_OOP;
 			} else if (!(ntp_timex.status & STA_INS)) {
@@ -211,8 +279,8 @@ void Clock::update(bool second) {
 			}
 			break;
 		case TIME_DEL:
-			if ((time_t)(time + 1.0 + 0.5) % (24 * 3600) <= 1) {
-				time += 1.0;
+			if ((time_t)(get_real_time() + 1.0 + 0.5) % (24 * 3600) <= 1) {
+				bank->set_time(bank_index, get_real_time() + 1.0);
 				ntp_timex.tai -= 1.0;
 				ntp_state = TIME_WAIT;
 			} else if (!(ntp_timex.status & STA_DEL)) {
@@ -229,6 +297,8 @@ void Clock::update(bool second) {
 		default:
 			assert(0);
 	}
+
+	rebase();
 }
 
 void Clock::update_ntp_offset(long offset) {
@@ -326,9 +396,11 @@ int Clock::adjtimex(struct timex *buf) {
 	}
 	if (buf->modes & ADJ_SETOFFSET) {
 		if (ntp_timex.status & STA_NANO)
-			time += buf->time.tv_sec + buf->time.tv_usec * 1e-9;
+			bank->set_time(bank_index, get_real_time() +
+					(buf->time.tv_sec + buf->time.tv_usec * 1e-9));
 		else
-			time += buf->time.tv_sec + buf->time.tv_usec * 1e-6;
+			bank->set_time(bank_index, get_real_time() +
+					(buf->time.tv_sec + buf->time.tv_usec * 1e-6));
 		ntp_timex.maxerror = MAXMAXERROR;
 	}
 	if (buf->modes & ADJ_TAI) {
@@ -348,6 +420,8 @@ int Clock::adjtimex(struct timex *buf) {
 
 	*buf = t;
 
+	rebase();
+
 	return r;
 }
 
@@ -361,6 +435,172 @@ int Clock::adjtime(const struct timeval *delta, struct timeval *olddelta) {
 	return 0;
 }
 
+static void resize_sums(struct Clock_bank_sums *sums, unsigned int n) {
+	sums->sum2.resize(n);
+	sums->abs_sum.resize(n);
+	sums->sum.resize(n);
+	sums->abs_max.resize(n);
+}
+
+static void reset_sums(struct Clock_bank_sums *sums) {
+	fill(sums->sum2.begin(), sums->sum2.end(), 0.0);
+	fill(sums->abs_sum.begin(), sums->abs_sum.end(), 0.0);
+	fill(sums->sum.begin(), sums->sum.end(), 0.0);
+	fill(sums->abs_max.begin(), sums->abs_max.end(), 0.0);
+}
+
+Clock_bank::Clock_bank(unsigned int n) {
+	n = (n + CLOCK_BANK_PADDING - 1) / CLOCK_BANK_PADDING * CLOCK_BANK_PADDING;
+
+	times.resize(n);
+	mono_times.resize(n);
+	network_times.resize(n);
+	base_times.resize(n);
+	base_mono_times.resize(n);
+	base_network_times.resize(n);
+	total_freqs.resize(n, 1.0);
+	raw_freqs.resize(n, 1.0);
+
+	offsets.resize(n);
+	resize_sums(&offset_sums, n);
+	resize_sums(&freq_sums, n);
+	resize_sums(&rawfreq_sums, n);
+	reset_stats(true);
+}
+
+Clock_bank::~Clock_bank() {
+}
+
+Sim_time Clock_bank::get_time(unsigned int index) const {
+	return times[index];
+}
+
+Sim_time Clock_bank::get_monotonic_time(unsigned int index) const {
+	return mono_times[index];
+}
+
+double Clock_bank::get_total_freq(unsigned int index) const {
+	return total_freqs[index];
+}
+
+double Clock_bank::get_raw_freq(unsigned int index) const {
+	return raw_freqs[index];
+}
+
+void Clock_bank::set_time(unsigned int index, Sim_time time) {
+	times[index] = time;
+}
+
+/* The time is always calculated from the base, which is moved only when
+   the frequency or time is changed, so it doesn't matter how often the
+   clock is advanced. */
+void Clock_bank::advance(unsigned int index, Sim_time network_time) {
+	Sim_time local_interval = (network_time - base_network_times[index]) * total_freqs[index];
+
+	times[index] = base_times[index] + local_interval;
+	mono_times[index] = base_mono_times[index] + local_interval;
+	network_times[index] = network_time;
+}
+
+void Clock_bank::rebase(unsigned int index, double total_freq, double raw_freq) {
+	base_times[index] = times[index];
+	base_mono_times[index] = mono_times[index];
+	base_network_times[index] = network_times[index];
+	total_freqs[index] = total_freq;
+	raw_freqs[index] = raw_freq;
+}
+
+/* The kernels work on all clocks in the bank. The number of clocks is a
+   multiple of the padding to avoid a remainder loop. */
+
+/* advance the clocks in the same way as advance() and calculate their
+   offsets */
+static void advance_clocks(Sim_time *__restrict times, Sim_time *__restrict mono_times,
+		Sim_time *__restrict network_times, const Sim_time *__restrict base_times,
+		const Sim_time *__restrict base_mono_times,
+		const Sim_time *__restrict base_network_times,
+		const double *__restrict total_freqs, Sim_time network_time,
+		double *__restrict offsets, unsigned int n) {
+	Sim_time local_interval;
+	unsigned int i;
+
+	n &= ~(CLOCK_BANK_PADDING - 1);
+
+	for (i = 0; i < n; i++) {
+		local_interval = (network_time - base_network_times[i]) * total_freqs[i];
+		times[i] = base_times[i] + local_interval;
+		mono_times[i] = base_mono_times[i] + local_interval;
+		network_times[i] = network_time;
+		offsets[i] = times[i] - network_time;
+	}
+}
+
+/* add the values minus the bias to the sums */
+static void accumulate_sums(const double *__restrict values, double bias,
+		double *__restrict sum2, double *__restrict abs_sum, double *__restrict sum,
+		double *__restrict abs_max, unsigned int n) {
+	unsigned int i;
+	double x;
+
+	n &= ~(CLOCK_BANK_PADDING - 1);
+
+	for (i = 0; i < n; i++) {
+		x = values[i] - bias;
+		sum2[i] += x * x;
+		abs_sum[i] += fabs(x);
+		sum[i] += x;
+		abs_max[i] = abs_max[i] < fabs(x) ? fabs(x) : abs_max[i];
+	}
+}
+
+static void accumulate(const vector<double> &values, double bias, struct Clock_bank_sums *sums) {
+	accumulate_sums(&values[0], bias, &sums->sum2[0], &sums->abs_sum[0], &sums->sum[0],
+			&sums->abs_max[0], values.size());
+}
+
+/* advance all clocks to the network time and add their offsets and
+   frequencies to the stats, return the offsets */
+const double *Clock_bank::update_stats(Sim_time network_time) {
+	advance_clocks(&times[0], &mono_times[0], &network_times[0], &base_times[0],
+			&base_mono_times[0], &base_network_times[0], &total_freqs[0],
+			network_time, &offsets[0], offsets.size());
+
+	accumulate(offsets, 0.0, &offset_sums);
+	accumulate(total_freqs, 1.0, &freq_sums);
+	accumulate(raw_freqs, 1.0, &rawfreq_sums);
+	samples++;
+	updates++;
+
+	return &offsets[0];
+}
+
+void Clock_bank::get_stats(unsigned int index, struct Clock_stats *stats) const {
+	stats->offset_sum2 = offset_sums.sum2[index];
+	stats->offset_abs_sum = offset_sums.abs_sum[index];
+	stats->offset_sum = offset_sums.sum[index];
+	stats->offset_abs_max = offset_sums.abs_max[index];
+	stats->freq_sum2 = freq_sums.sum2[index];
+	stats->freq_abs_sum = freq_sums.abs_sum[index];
+	stats->freq_sum = freq_sums.sum[index];
+	stats->freq_abs_max = freq_sums.abs_max[index];
+	stats->rawfreq_sum2 = rawfreq_sums.sum2[index];
+	stats->rawfreq_abs_sum = rawfreq_sums.abs_sum[index];
+	stats->rawfreq_sum = rawfreq_sums.sum[index];
+	stats->rawfreq_abs_max = rawfreq_sums.abs_max[index];
+	stats->samples = samples;
+	stats->updates = updates;
+}
+
+/* reset the sums, and with all also the number of updates */
+void Clock_bank::reset_stats(bool all) {
+	reset_sums(&offset_sums);
+	reset_sums(&freq_sums);
+	reset_sums(&rawfreq_sums);
+	samples = 0;
+	if (all)
+		updates = 0;
+}
+
 Refclock::Refclock() {
 	time = 0.0;
 	offset = 0.0;
@@ -384,12 +624,12 @@ void Refclock::set_generation(bool enable) {
 	generate = enable;
 }
 
-void Refclock::update(double time, const Clock *clock) {
+void Refclock::update(Sim_time time, const Clock *clock) {
 	if (!generate || !offset_generator)
 		return;
 
 	this->time = clock->get_real_time();
-	offset = this->time - time + offset_generator->generate(NULL);
+	offset = clock->get_real_time() - time + offset_generator->generate(NULL);
 	valid = true;
 }
 
@@ -399,9 +639,11 @@ bool Refclock::get_sample(double *time, double *offset) const {
 	return valid;
 }
 
-void Refclock::get_offsets(double *offsets, int size) {
-	int i;
+bool Refclock::needs_updates() const {
+	return generate && offset_generator;
+}
 
-	for (i = 0; i < size; i++)
-		offsets[i] = offset_generator->generate(NULL);
+void Refclock::get_offsets(double *offsets, int size) {
+	assert(size >= 0);
+	offset_generator->generate_n(NULL, offsets, size);
 }
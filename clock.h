@@ -22,16 +22,98 @@
 
 #include "generator.h"
 
+/* type of the simulated time, long double can be selected for long
+   simulations where double doesn't have enough precision */
+#ifdef CLKNETSIM_LONG_TIME
+typedef long double Sim_time;
+#else
+typedef double Sim_time;
+#endif
+
 #define CLOCK_NTP_FLL_MODE2 0x1
 #define CLOCK_NTP_PLL_CLAMP 0x2
 
+/* the arrays in the clock bank are padded to a multiple of this size,
+   which needs to be a power of two */
+#define CLOCK_BANK_PADDING 4
+
+/* sums of the offsets and frequencies of a clock since the last reset */
+struct Clock_stats {
+	double offset_sum2;
+	double offset_abs_sum;
+	double offset_sum;
+	double offset_abs_max;
+	double freq_sum2;
+	double freq_abs_sum;
+	double freq_sum;
+	double freq_abs_max;
+	double rawfreq_sum2;
+	double rawfreq_abs_sum;
+	double rawfreq_sum;
+	double rawfreq_abs_max;
+	unsigned long samples;
+
+	/* samples since the start, not reset with the clock stats */
+	unsigned long updates;
+};
+
+struct Clock_bank_sums {
+	vector<double> sum2;
+	vector<double> abs_sum;
+	vector<double> sum;
+	vector<double> abs_max;
+};
+
+/* State of the clocks of all nodes which changes as they are advanced,
+   and sums of their stats, stored in separate arrays. The clocks can be
+   advanced one by one when they are accessed, or all at once in vectorised
+   loops when their stats are sampled. */
+class Clock_bank {
+	vector<Sim_time> times;
+	vector<Sim_time> mono_times;
+	vector<Sim_time> network_times;
+
+	/* time, monotonic time and network time from which the clocks are
+	   running at the current frequency */
+	vector<Sim_time> base_times;
+	vector<Sim_time> base_mono_times;
+	vector<Sim_time> base_network_times;
+
+	/* frequencies calculated when the clocks are rebased */
+	vector<double> total_freqs;
+	vector<double> raw_freqs;
+
+	vector<double> offsets;
+	struct Clock_bank_sums offset_sums;
+	struct Clock_bank_sums freq_sums;
+	struct Clock_bank_sums rawfreq_sums;
+	unsigned long samples;
+	unsigned long updates;
+
+public:
+	Clock_bank(unsigned int n);
+	~Clock_bank();
+	Sim_time get_time(unsigned int index) const;
+	Sim_time get_monotonic_time(unsigned int index) const;
+	double get_total_freq(unsigned int index) const;
+	double get_raw_freq(unsigned int index) const;
+	void set_time(unsigned int index, Sim_time time);
+	void advance(unsigned int index, Sim_time network_time);
+	void rebase(unsigned int index, double total_freq, double raw_freq);
+	const double *update_stats(Sim_time network_time);
+	void get_stats(unsigned int index, struct Clock_stats *stats) const;
+	void reset_stats(bool all);
+};
+
+/* clock of a node, its time is kept in the clock bank */
 class Clock {
-	double time;
-	double mono_time;
+	Clock_bank *bank;
+	unsigned int bank_index;
+
 	double freq;
 
-	Generator *freq_generator;
-	Generator *step_generator;
+	Generator_buffer freq_generator;
+	Generator_buffer step_generator;
 
 	long base_tick;
 
@@ -46,25 +128,30 @@ class Clock {
 	long ss_offset;
 	long ss_slew;
 
+	void rebase();
+	double get_local_interval_updates(double updates) const;
 public:
-	Clock();
+	Clock(Clock_bank *bank, unsigned int index);
 	~Clock();
-	double get_real_time() const;
-	double get_monotonic_time() const;
+	Sim_time get_real_time() const;
+	Sim_time get_monotonic_time() const;
 	double get_total_freq() const;
 	double get_raw_freq() const;
 	double get_true_interval(double local_interval) const;
 	double get_local_interval(double true_interval) const;
+	double get_true_interval_updates(double local_interval, double update_interval) const;
+	bool can_batch_updates() const;
+	bool needs_update(bool second) const;
 
 	void set_freq_generator(Generator *gen);
 	void set_step_generator(Generator *gen);
 	void set_freq(double freq);
-	void set_time(double time);
+	void set_time(Sim_time time);
 	void step_time(double step);
 	void set_ntp_shift_pll(int shift);
 	void set_ntp_flag(int enable, int flag);
 
-	void advance(double real_interval);
+	void advance(Sim_time network_time);
 	void update(bool second);
 
 	void update_ntp_offset(long offset);
@@ -83,10 +170,11 @@ public:
 	Refclock();
 	~Refclock();
 	void set_offset_generator(Generator *gen);
-	void update(double time, const Clock *clock);
+	void update(Sim_time time, const Clock *clock);
 	void set_generation(bool enable);
 	bool get_sample(double *time, double *offset) const;
 	void get_offsets(double *offsets, int size);
+	bool needs_updates() const;
 };
 
 #endif
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2010  Miroslav Lichvar <mlichvar@redhat.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Waiting for a change of a shared value. The waiting side spins for a
+   while and then sleeps on a futex. It sets a flag when sleeping, so the
+   side changing the value makes the system call only when needed. */
+
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define FUTEX_WAIT_SPINS 1000
+
+/* the client has its own syscall() */
+#ifndef FUTEX_SYSCALL
+#define FUTEX_SYSCALL syscall
+#endif
+
+/* wait until the value is different from val, return 0 on timeout */
+static inline int futex_wait(uint32_t *value, uint32_t *waiting, uint32_t val, int timeout) {
+	struct timespec ts;
+	int i;
+
+	for (i = 0; i < FUTEX_WAIT_SPINS; i++) {
+		if (__atomic_load_n(value, __ATOMIC_ACQUIRE) != val)
+			return 1;
+	}
+
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(value, __ATOMIC_SEQ_CST) == val) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = timeout % 1000 * 1000000;
+		FUTEX_SYSCALL(SYS_futex, value, FUTEX_WAIT, val, &ts, NULL, 0);
+	}
+	__atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE) != val;
+}
+
+/* wake up the side waiting for a change of the value */
+static inline void futex_wake(uint32_t *value, uint32_t *waiting) {
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+		FUTEX_SYSCALL(SYS_futex, value, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+#endif
@@ -17,6 +17,12 @@
 
 #include "generator.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "futex.h"
+
+#include <pthread.h>
+
 static void syntax_assert(bool condition) {
 	if (!condition) {
 		fprintf(stderr, "syntax error\n");
@@ -28,11 +34,12 @@ Generator::Generator(const vector<Generator *> *input) {
 	if (input)
 		this->input = *input;
 	constant = false;
+	references = 1;
 }
 
 Generator::~Generator() {
 	while (!input.empty()) {
-		delete input.back();
+		input.back()->unreference();
 		input.pop_back();
 	}
 }
@@ -41,6 +48,475 @@ bool Generator::is_constant() const {
 	return constant;
 }
 
+/* generators shared by multiple expressions are deleted with the last
+   reference */
+void Generator::reference() {
+	references++;
+}
+
+void Generator::unreference() {
+	assert(references > 0);
+	if (!--references)
+		delete this;
+}
+
+/* the generator is constant if all its inputs are constant */
+void Generator::set_constant_input() {
+	unsigned int i;
+
+	for (i = 0, constant = true; i < input.size(); i++) {
+		if (!input[i]->is_constant())
+			constant = false;
+	}
+}
+
+/* generators which can't be compiled into instructions are called from
+   the program */
+void Generator::compile(Generator_program *program) {
+	program->add_call(this);
+}
+
+void Generator::compile_input(Generator_program *program) {
+	unsigned int i;
+
+	for (i = 0; i < input.size(); i++)
+		input[i]->compile(program);
+}
+
+/* the default is to generate the values one by one */
+void Generator::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		values[i] = generate(variables);
+}
+
+/* generate blocks of n values from all inputs, the block of input i starts
+   at i * n. Each generator has its own state, so the values are the same
+   as if they were generated one by one. */
+double *Generator::generate_input(const Generator_variables *variables, unsigned int n) {
+	unsigned int i;
+
+	if (buffer.size() < input.size() * n)
+		buffer.resize(input.size() * n);
+
+	for (i = 0; i < input.size(); i++)
+		input[i]->generate_n(variables, &buffer[i * n], n);
+
+	return &buffer[0];
+}
+
+uint64_t Generator_random_stream::seed = 0;
+uint64_t Generator_random_stream::streams = 0;
+bool Generator_random_stream::ziggurat = true;
+bool Generator_random_stream::producer = false;
+
+/* tables for the ziggurat method (Marsaglia and Tsang, 2000) */
+#define ZIGGURAT_NORMAL_R 3.442619855899
+#define ZIGGURAT_NORMAL_V 9.91256303526217e-3
+#define ZIGGURAT_EXP_R 7.697117470131487
+#define ZIGGURAT_EXP_V 3.949659822581572e-3
+
+static uint32_t ziggurat_kn[128], ziggurat_ke[256];
+static double ziggurat_wn[128], ziggurat_fn[128], ziggurat_we[256], ziggurat_fe[256];
+static bool ziggurat_ready = false;
+
+static void init_ziggurat() {
+	double m1 = 2147483648.0, m2 = 4294967296.0, dn, tn, de, te, q;
+	int i;
+
+	dn = tn = ZIGGURAT_NORMAL_R;
+	q = ZIGGURAT_NORMAL_V / exp(-0.5 * dn * dn);
+	ziggurat_kn[0] = dn / q * m1;
+	ziggurat_kn[1] = 0;
+	ziggurat_wn[0] = q / m1;
+	ziggurat_wn[127] = dn / m1;
+	ziggurat_fn[0] = 1.0;
+	ziggurat_fn[127] = exp(-0.5 * dn * dn);
+
+	for (i = 126; i >= 1; i--) {
+		dn = sqrt(-2.0 * log(ZIGGURAT_NORMAL_V / dn + exp(-0.5 * dn * dn)));
+		ziggurat_kn[i + 1] = dn / tn * m1;
+		tn = dn;
+		ziggurat_fn[i] = exp(-0.5 * dn * dn);
+		ziggurat_wn[i] = dn / m1;
+	}
+
+	de = te = ZIGGURAT_EXP_R;
+	q = ZIGGURAT_EXP_V / exp(-de);
+	ziggurat_ke[0] = de / q * m2;
+	ziggurat_ke[1] = 0;
+	ziggurat_we[0] = q / m2;
+	ziggurat_we[255] = de / m2;
+	ziggurat_fe[0] = 1.0;
+	ziggurat_fe[255] = exp(-de);
+
+	for (i = 254; i >= 1; i--) {
+		de = -log(ZIGGURAT_EXP_V / de + exp(-de));
+		ziggurat_ke[i + 1] = de / te * m2;
+		te = de;
+		ziggurat_fe[i] = exp(-de);
+		ziggurat_we[i] = de / m2;
+	}
+
+	ziggurat_ready = true;
+}
+
+static uint64_t splitmix64(uint64_t *x) {
+	uint64_t z;
+
+	z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+Generator_random_stream::Generator_random_stream() {
+	uint64_t x = streams++, y;
+	int i;
+
+	y = seed ^ splitmix64(&x);
+	for (i = 0; i < 4; i++)
+		state[i] = splitmix64(&y);
+
+	ring = NULL;
+	direct = false;
+
+	if (!ziggurat_ready)
+		init_ziggurat();
+}
+
+void Generator_random_stream::set_seed(uint64_t seed) {
+	Generator_random_stream::seed = seed;
+	streams = 0;
+}
+
+/* select the polar method and logarithm instead of the ziggurat method for
+   the normal and exponential distributions */
+void Generator_random_stream::set_ziggurat(bool enable) {
+	ziggurat = enable;
+}
+
+#define GENERATOR_RING_MIN_SIZE 256
+#define GENERATOR_RING_MAX_SIZE 4096
+#define GENERATOR_RING_CHUNK 64
+
+/* single-producer single-consumer ring of numbers generated by the producer
+   thread. The ring starts small and the producer doubles its size when it
+   finds it drained, which can be done only when it's empty. The consumer
+   closes the ring and the producer frees it. */
+struct Generator_random_ring {
+	Generator_random_stream stream;
+	Generator_distribution distribution;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t head_waiting;
+	uint32_t size;
+	double *values;
+
+	/* used only by the consumer */
+	uint32_t last_head;
+	bool requested;
+
+	/* protected by producer_mutex */
+	bool queued;
+	bool closed;
+
+	Generator_random_ring(const Generator_random_stream &stream): stream(stream) {}
+	~Generator_random_ring() { delete[] values; }
+};
+
+/* not destroyed at exit as the thread is still running */
+static vector<Generator_random_ring *> *producer_queue;
+static pthread_mutex_t producer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t producer_requests;
+static uint32_t producer_waiting;
+
+/* queue the ring for the producer to fill it or free it */
+static void queue_ring(Generator_random_ring *ring, bool close) {
+	bool queued;
+
+	pthread_mutex_lock(&producer_mutex);
+	if (close)
+		ring->closed = true;
+	queued = ring->queued;
+	if (!queued) {
+		ring->queued = true;
+		producer_queue->push_back(ring);
+	}
+	pthread_mutex_unlock(&producer_mutex);
+
+	if (!queued) {
+		__atomic_add_fetch(&producer_requests, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&producer_requests, &producer_waiting);
+	}
+}
+
+static void fill_ring(Generator_random_ring *ring) {
+	uint32_t head, tail;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	/* the consumer doesn't access the values when the ring is empty */
+	if (!ring->values || (head == tail && ring->size < GENERATOR_RING_MAX_SIZE)) {
+		ring->size = ring->values ? 2 * ring->size : GENERATOR_RING_MIN_SIZE;
+		delete[] ring->values;
+		ring->values = new double[ring->size];
+	}
+
+	/* publish the numbers in chunks to not keep the consumer
+	   waiting for the whole ring */
+	while (head - tail < ring->size) {
+		ring->values[head % ring->size] = ring->stream.generate(ring->distribution);
+		head++;
+
+		if (head % GENERATOR_RING_CHUNK == 0 || head - tail == ring->size) {
+			__atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+			futex_wake(&ring->head, &ring->head_waiting);
+		}
+	}
+}
+
+static void *run_producer(void *arg) {
+	vector<Generator_random_ring *> rings;
+	uint32_t requests;
+	unsigned int i, j;
+
+	while (1) {
+		requests = __atomic_load_n(&producer_requests, __ATOMIC_SEQ_CST);
+
+		pthread_mutex_lock(&producer_mutex);
+		rings.swap(*producer_queue);
+		for (i = j = 0; i < rings.size(); i++) {
+			rings[i]->queued = false;
+			if (rings[i]->closed)
+				delete rings[i];
+			else
+				rings[j++] = rings[i];
+		}
+		rings.resize(j);
+		pthread_mutex_unlock(&producer_mutex);
+
+		for (i = 0; i < rings.size(); i++)
+			fill_ring(rings[i]);
+		rings.clear();
+
+		/* sleep until a ring is half empty or a new ring is added */
+		futex_wait(&producer_requests, &producer_waiting, requests, 1000);
+	}
+
+	return NULL;
+}
+
+/* generate the numbers in a separate thread */
+void Generator_random_stream::set_producer(bool enable) {
+	pthread_t thread;
+
+	if (producer == enable)
+		return;
+	assert(enable);
+
+	producer_queue = new vector<Generator_random_ring *>;
+	if (pthread_create(&thread, NULL, run_producer, NULL) ||
+			pthread_detach(thread)) {
+		fprintf(stderr, "can't create producer thread\n");
+		exit(1);
+	}
+	producer = true;
+}
+
+Generator_random_stream::~Generator_random_stream() {
+	if (ring)
+		queue_ring(ring, true);
+}
+
+double Generator_random_stream::pop(Generator_distribution distribution) {
+	uint32_t head, tail, size;
+	double x;
+
+	if (!ring) {
+		ring = new Generator_random_ring(*this);
+		ring->stream.ring = NULL;
+		ring->stream.direct = true;
+		ring->distribution = distribution;
+		ring->head = ring->tail = 0;
+		ring->head_waiting = 0;
+		ring->size = 0;
+		ring->values = NULL;
+		ring->last_head = 0;
+		ring->requested = false;
+		ring->queued = ring->closed = false;
+		queue_ring(ring, false);
+	}
+
+	assert(ring->distribution == distribution);
+
+	tail = ring->tail;
+	while ((head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) == tail)
+		futex_wait(&ring->head, &ring->head_waiting, tail, 1000);
+
+	/* the size can change only after the ring is drained */
+	size = ring->size;
+	x = ring->values[tail % size];
+	__atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+
+	/* request more numbers once for each published head when the ring is
+	   half empty (the consumer might have missed the exact half while the
+	   producer was publishing the chunks) */
+	if (head != ring->last_head) {
+		ring->last_head = head;
+		ring->requested = false;
+	}
+	if (!ring->requested && head - tail <= size / 2) {
+		ring->requested = true;
+		queue_ring(ring, false);
+	}
+
+	return x;
+}
+
+double Generator_random_stream::generate(Generator_distribution distribution) {
+	switch (distribution) {
+		case GENERATOR_DISTRIBUTION_UNIFORM:
+			return uniform();
+		case GENERATOR_DISTRIBUTION_NORMAL:
+			return normal();
+		case GENERATOR_DISTRIBUTION_EXPONENTIAL:
+			return exponential();
+	}
+
+	assert(0);
+	return 0.0;
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+uint64_t Generator_random_stream::next() {
+	uint64_t r, t;
+
+	r = rotl(state[1] * 5, 7) * 9;
+	t = state[1] << 17;
+
+	state[2] ^= state[0];
+	state[3] ^= state[1];
+	state[1] ^= state[2];
+	state[0] ^= state[3];
+	state[2] ^= t;
+	state[3] = rotl(state[3], 45);
+
+	return r;
+}
+
+/* uniform distribution in (0, 1) */
+double Generator_random_stream::uniform() {
+	if (producer && !direct)
+		return pop(GENERATOR_DISTRIBUTION_UNIFORM);
+
+	return ((next() >> 11) + 0.5) / 9007199254740992.0;
+}
+
+double Generator_random_stream::normal() {
+	double x, y, s;
+	uint64_t r;
+	int64_t hz;
+	unsigned int iz;
+
+	if (producer && !direct)
+		return pop(GENERATOR_DISTRIBUTION_NORMAL);
+
+	if (ziggurat) {
+		/* the index and value are taken from different bits */
+		r = next();
+		hz = (int32_t)(r >> 32);
+		iz = r & 127;
+		if ((uint64_t)(hz < 0 ? -hz : hz) < ziggurat_kn[iz])
+			return hz * ziggurat_wn[iz];
+		return normal_tail(hz, iz);
+	}
+
+	/* Marsaglia polar method */
+
+	do {
+		x = 2.0 * uniform() - 1.0;
+		y = 2.0 * uniform() - 1.0;
+		s = x * x + y * y;
+	} while (s >= 1.0);
+
+	x *= sqrt(-2.0 * log(s) / s);
+
+	return x;
+}
+
+double Generator_random_stream::normal_tail(int64_t hz, unsigned int iz) {
+	double x, y;
+	uint64_t r;
+
+	while (1) {
+		x = hz * ziggurat_wn[iz];
+
+		if (iz == 0) {
+			do {
+				x = -log(uniform()) / ZIGGURAT_NORMAL_R;
+				y = -log(uniform());
+			} while (y + y < x * x);
+			return hz > 0 ? ZIGGURAT_NORMAL_R + x : -ZIGGURAT_NORMAL_R - x;
+		}
+
+		if (ziggurat_fn[iz] + uniform() * (ziggurat_fn[iz - 1] - ziggurat_fn[iz]) <
+				exp(-0.5 * x * x))
+			return x;
+
+		r = next();
+		hz = (int32_t)(r >> 32);
+		iz = r & 127;
+		if ((uint64_t)(hz < 0 ? -hz : hz) < ziggurat_kn[iz])
+			return hz * ziggurat_wn[iz];
+	}
+}
+
+double Generator_random_stream::exponential() {
+	uint64_t r;
+	uint32_t jz;
+	unsigned int iz;
+
+	if (producer && !direct)
+		return pop(GENERATOR_DISTRIBUTION_EXPONENTIAL);
+
+	if (!ziggurat)
+		return -log(uniform());
+
+	r = next();
+	jz = r >> 32;
+	iz = r & 255;
+	if (jz < ziggurat_ke[iz])
+		return jz * ziggurat_we[iz];
+
+	return exponential_tail(jz, iz);
+}
+
+double Generator_random_stream::exponential_tail(uint32_t jz, unsigned int iz) {
+	double x;
+	uint64_t r;
+
+	while (1) {
+		if (iz == 0)
+			return ZIGGURAT_EXP_R - log(uniform());
+
+		x = jz * ziggurat_we[iz];
+		if (ziggurat_fe[iz] + uniform() * (ziggurat_fe[iz - 1] - ziggurat_fe[iz]) < exp(-x))
+			return x;
+
+		r = next();
+		jz = r >> 32;
+		iz = r & 255;
+		if (jz < ziggurat_ke[iz])
+			return jz * ziggurat_we[iz];
+	}
+}
+
 Generator_float::Generator_float(double f): Generator(NULL) {
 	this->f = f;
 	constant = true;
@@ -50,18 +526,49 @@ double Generator_float::generate(const Generator_variables *variables) {
 	return f;
 }
 
+void Generator_float::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		values[i] = f;
+}
+
+void Generator_float::compile(Generator_program *program) {
+	program->add_instruction(GENERATOR_OP_FLOAT, 0, f);
+}
+
 Generator_variable::Generator_variable(string name): Generator(NULL) {
-	this->name = name;
+	if (name == "time")
+		index = GENERATOR_VARIABLE_TIME;
+	else if (name == "from")
+		index = GENERATOR_VARIABLE_FROM;
+	else if (name == "to")
+		index = GENERATOR_VARIABLE_TO;
+	else if (name == "subnet")
+		index = GENERATOR_VARIABLE_SUBNET;
+	else if (name == "port")
+		index = GENERATOR_VARIABLE_PORT;
+	else if (name == "length")
+		index = GENERATOR_VARIABLE_LENGTH;
+	else
+		syntax_assert(0);
 }
 
 double Generator_variable::generate(const Generator_variables *variables) {
-	Generator_variables::const_iterator iter;
+	syntax_assert(variables);
+	return variables->values[index];
+}
+
+void Generator_variable::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i;
 
 	syntax_assert(variables);
-	iter = variables->find(name);
-	syntax_assert(iter != variables->end());
+	for (i = 0; i < n; i++)
+		values[i] = variables->values[index];
+}
 
-	return iter->second;
+void Generator_variable::compile(Generator_program *program) {
+	program->add_variable(index);
 }
 
 Generator_random_uniform::Generator_random_uniform(const vector<Generator *> *input):
@@ -70,94 +577,414 @@ Generator_random_uniform::Generator_random_uniform(const vector<Generator *> *in
 }
 
 double Generator_random_uniform::generate(const Generator_variables *variables) {
-	double x;
+	return random.uniform();
+}
+
+void Generator_random_uniform::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i;
 
-	x = ((random() & 0x7fffffff) + 1) / 2147483649.0;
-	x = ((random() & 0x7fffffff) + x) / 2147483648.0;
+	for (i = 0; i < n; i++)
+		values[i] = random.uniform();
+}
 
-	return x;
+void Generator_random_uniform::compile(Generator_program *program) {
+	program->add_random(GENERATOR_OP_UNIFORM, &random);
 }
 
 Generator_random_normal::Generator_random_normal(const vector<Generator *> *input):
-	Generator(NULL), uniform(NULL) {
+	Generator(NULL) {
 	syntax_assert(!input || input->size() == 0);
 }
 
 double Generator_random_normal::generate(const Generator_variables *variables) {
-	/* Marsaglia polar method */
-
-	double x, y, s;
+	return random.normal();
+}
 
-	do {
-		x = 2.0 * uniform.generate(variables) - 1.0;
-		y = 2.0 * uniform.generate(variables) - 1.0;
-		s = x * x + y * y;
-	} while (s >= 1.0);
+void Generator_random_normal::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i;
 
-	x *= sqrt(-2.0 * log(s) / s);
+	for (i = 0; i < n; i++)
+		values[i] = random.normal();
+}
 
-	return x;
+void Generator_random_normal::compile(Generator_program *program) {
+	program->add_random(GENERATOR_OP_NORMAL, &random);
 }
 
 Generator_random_exponential::Generator_random_exponential(const vector<Generator *> *input):
-	Generator(NULL), uniform(NULL) {
+	Generator(NULL) {
 	syntax_assert(!input || input->size() == 0);
 }
 
 double Generator_random_exponential::generate(const Generator_variables *variables) {
-	return -log(uniform.generate(variables));
+	return random.exponential();
 }
 
-Generator_random_poisson::Generator_random_poisson(const vector<Generator *> *input):
-	Generator(NULL), uniform(NULL) {
-	double lambda;
+void Generator_random_exponential::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i;
 
+	for (i = 0; i < n; i++)
+		values[i] = random.exponential();
+}
+
+void Generator_random_exponential::compile(Generator_program *program) {
+	program->add_random(GENERATOR_OP_EXPONENTIAL, &random);
+}
+
+Generator_random_poisson::Generator_random_poisson(const vector<Generator *> *input):
+	Generator(NULL) {
 	syntax_assert(input && input->size() == 1 && (*input)[0]->is_constant());
 
 	lambda = (*input)[0]->generate(NULL);
-	syntax_assert(lambda >= 1 && lambda <= 20);
+	syntax_assert(lambda >= 0.0 && lambda <= 1e12);
 	L = exp(-lambda);
+
+	log_lambda = log(lambda);
+	b = 0.931 + 2.53 * sqrt(lambda);
+	a = -0.059 + 0.02483 * b;
+	inv_alpha = 1.1239 + 1.1328 / (b - 3.4);
+	v_r = 0.9277 - 3.6224 / (b - 2.0);
 }
 
 double Generator_random_poisson::generate(const Generator_variables *variables) {
-	double p;
-	int k;
+	double p, u, v, us, k;
+
+	if (lambda < 10.0) {
+		for (p = 1.0, k = 0; k < 100; k++) {
+			p *= random.uniform();
+			if (p <= L)
+				break;
+		}
 
-	for (p = 1.0, k = 0; k < 100; k++) {
-		p *= uniform.generate(variables);
-		if (p <= L)
-			break;
+		return k;
 	}
 
-	return k;
+	while (1) {
+		u = random.uniform() - 0.5;
+		v = random.uniform();
+		us = 0.5 - fabs(u);
+		k = floor((2.0 * a / us + b) * u + lambda + 0.43);
+
+		if (us >= 0.07 && v <= v_r)
+			return k;
+		if (k < 0.0 || (us < 0.013 && v > us))
+			continue;
+		if (log(v) + log(inv_alpha) - log(a / (us * us) + b) <=
+				-lambda + k * log_lambda - lgamma(k + 1.0))
+			return k;
+	}
 }
 
-Generator_file::Generator_file(const char *file): Generator(NULL) {
+Generator_random_powerlaw::Generator_random_powerlaw(const vector<Generator *> *input):
+	Generator(NULL) {
+	double alpha;
+	int i;
+
+	syntax_assert(input && input->size() == 1 && (*input)[0]->is_constant());
+
+	alpha = (*input)[0]->generate(NULL);
+	syntax_assert(alpha > 0.0 && alpha < 2.0);
+
+	/* row i is updated every 2^i samples, its variance is (2^i)^(alpha - 1)
+	   to get the slope of the spectrum */
+	for (i = 0, sum = 0.0; i < GENERATOR_POWERLAW_ROWS; i++) {
+		scale[i] = pow(2.0, i * (alpha - 1.0) / 2.0);
+		rows[i] = scale[i] * random.normal();
+		if (i > 0)
+			sum += rows[i];
+	}
+	counter = 0;
+}
+
+double Generator_random_powerlaw::generate(const Generator_variables *variables) {
+	int i;
+
+	counter++;
+	i = __builtin_ctzll(counter) + 1;
+
+	if (i < GENERATOR_POWERLAW_ROWS) {
+		sum -= rows[i];
+		rows[i] = scale[i] * random.normal();
+		sum += rows[i];
+
+		/* remove accumulated rounding errors */
+		if (i >= GENERATOR_POWERLAW_ROWS / 2) {
+			for (i = 1, sum = 0.0; i < GENERATOR_POWERLAW_ROWS; i++)
+				sum += rows[i];
+		}
+	}
+
+	/* row 0 is updated in every sample */
+	return sum + scale[0] * random.normal();
+}
+
+void Generator_random_powerlaw::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		values[i] = Generator_random_powerlaw::generate(variables);
+}
+
+map<string, Generator_trace_data *> Generator_trace_data::files;
+
+Generator_trace_data::Generator_trace_data(const string &name) {
+	this->name = name;
+	references = 1;
+	data = NULL;
+	data_size = 0;
+	values = NULL;
+	size = 0;
+}
+
+Generator_trace_data::~Generator_trace_data() {
+	if (data)
+		munmap(data, data_size);
+}
+
+/* map the file if it's in the binary format */
+bool Generator_trace_data::map_binary(const char *file) {
+	char magic[GENERATOR_TRACE_MAGIC_LEN];
+	struct stat st;
+	int fd;
+
+	fd = ::open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || st.st_size < GENERATOR_TRACE_MAGIC_LEN ||
+			(st.st_size - GENERATOR_TRACE_MAGIC_LEN) % sizeof (double) ||
+			read(fd, magic, sizeof (magic)) != sizeof (magic) ||
+			memcmp(magic, GENERATOR_TRACE_MAGIC, sizeof (magic))) {
+		::close(fd);
+		return false;
+	}
+
+	data_size = st.st_size;
+	data = mmap(NULL, data_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (data == MAP_FAILED) {
+		data = NULL;
+		return false;
+	}
+
+	values = (const double *)((char *)data + GENERATOR_TRACE_MAGIC_LEN);
+	size = (data_size - GENERATOR_TRACE_MAGIC_LEN) / sizeof (double);
+
+	return true;
+}
+
+/* parse the text file and save the values in the binary format to the cache,
+   if it can't be written the values are kept in memory */
+bool Generator_trace_data::convert_text(const char *file, const char *cache) {
+	FILE *input, *output;
+	char pid[16];
+	string tmp;
+	double x;
+	int r;
+	bool saved;
+
 	input = fopen(file, "r");
-	if (!input) {
+	if (!input)
+		return false;
+
+	while ((r = fscanf(input, "%lf", &x)) == 1)
+		converted.push_back(x);
+
+	if (r != EOF || ferror(input)) {
+		fprintf(stderr, "invalid number in %s\n", file);
+		exit(1);
+	}
+	fclose(input);
+
+	if (converted.empty())
+		return true;
+
+	snprintf(pid, sizeof (pid), ".%d", (int)getpid());
+	tmp = string(cache) + pid;
+	output = fopen(tmp.c_str(), "w");
+	if (output) {
+		saved = fwrite(GENERATOR_TRACE_MAGIC, GENERATOR_TRACE_MAGIC_LEN, 1, output) == 1 &&
+			fwrite(&converted[0], sizeof (double), converted.size(), output) ==
+				converted.size();
+		saved = !fclose(output) && saved;
+
+		/* other instances may be converting the same file */
+		if (saved && !rename(tmp.c_str(), cache) && map_binary(cache)) {
+			vector<double>().swap(converted);
+			return true;
+		}
+		unlink(tmp.c_str());
+	}
+
+	values = &converted[0];
+	size = converted.size();
+
+	return true;
+}
+
+Generator_trace_data *Generator_trace_data::open(const char *file) {
+	Generator_trace_data *trace;
+	struct stat st, cache_st;
+	string name, cache;
+	char *path;
+
+	path = realpath(file, NULL);
+	if (!path || stat(path, &st) < 0) {
+		fprintf(stderr, "can't open %s\n", file);
+		exit(1);
+	}
+	name = path;
+	free(path);
+
+	if (files.find(name) != files.end()) {
+		trace = files[name];
+		trace->references++;
+		return trace;
+	}
+
+	trace = new Generator_trace_data(name);
+	cache = name + ".bin";
+
+	/* use the cache only if it's not older than the text file */
+	if (!trace->map_binary(name.c_str()) &&
+			(stat(cache.c_str(), &cache_st) < 0 ||
+			 cache_st.st_mtim.tv_sec < st.st_mtim.tv_sec ||
+			 (cache_st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+			  cache_st.st_mtim.tv_nsec < st.st_mtim.tv_nsec) ||
+			 !trace->map_binary(cache.c_str())) &&
+			!trace->convert_text(name.c_str(), cache.c_str())) {
 		fprintf(stderr, "can't open %s\n", file);
 		exit(1);
 	}
+
+	if (!trace->size) {
+		fprintf(stderr, "no values in %s\n", file);
+		exit(1);
+	}
+
+	files[name] = trace;
+
+	return trace;
+}
+
+void Generator_trace_data::close() {
+	assert(references > 0);
+	if (!--references) {
+		files.erase(name);
+		delete this;
+	}
+}
+
+const double *Generator_trace_data::get_values() const {
+	return values;
+}
+
+size_t Generator_trace_data::get_size() const {
+	return size;
+}
+
+Generator_file::Generator_file(const char *file): Generator(NULL) {
+	trace = Generator_trace_data::open(file);
+	index = 0;
 }
 
 Generator_file::~Generator_file() {
-	fclose(input);
+	trace->close();
 }
 
 double Generator_file::generate(const Generator_variables *variables) {
-	double x;
+	double x = trace->get_values()[index++];
 
-	while (1) {
-		if (fscanf(input, "%lf", &x) != 1) {
-			if (feof(input)) {
-				fseek(input, 0, SEEK_SET);
-				continue;
+	if (index >= trace->get_size())
+		index = 0;
+	return x;
+}
+
+void Generator_file::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	size_t l, size = trace->get_size();
+
+	while (n > 0) {
+		l = size - index;
+		if (l > n)
+			l = n;
+		memcpy(values, trace->get_values() + index, l * sizeof (double));
+		values += l;
+		n -= l;
+		index += l;
+		if (index >= size)
+			index = 0;
+	}
+}
+
+Generator_trace::Generator_trace(const char *file, const vector<Generator *> *input):
+	Generator(input) {
+	syntax_assert(file && (!input || input->size() <= 1));
+	trace = Generator_trace_data::open(file);
+	if (trace->get_size() % 2) {
+		fprintf(stderr, "odd number of values in %s\n", file);
+		exit(1);
+	}
+	index = 0;
+}
+
+Generator_trace::~Generator_trace() {
+	trace->close();
+}
+
+double Generator_trace::lookup(double x) {
+	const double *t = trace->get_values();
+	size_t i, lo, hi, n = trace->get_size() / 2;
+
+	if (x <= t[0])
+		return t[1];
+	if (x >= t[2 * (n - 1)])
+		return t[2 * n - 1];
+
+	/* find the interval containing x, try the last one and the next one
+	   before searching the whole trace */
+	i = index;
+	if (!(t[2 * i] <= x && x < t[2 * i + 2])) {
+		if (i + 2 < n && t[2 * i + 2] <= x && x < t[2 * i + 4]) {
+			i++;
+		} else {
+			for (lo = 0, hi = n - 1; hi - lo > 1; ) {
+				i = (lo + hi) / 2;
+				if (t[2 * i] <= x)
+					lo = i;
+				else
+					hi = i;
 			}
-			assert(0);
+			i = lo;
 		}
-		break;
+		index = i;
 	}
-	return x;
+
+	t += 2 * i;
+	if (t[2] <= t[0])
+		return t[1];
+	return t[1] + (t[3] - t[1]) * (x - t[0]) / (t[2] - t[0]);
+}
+
+double Generator_trace::generate(const Generator_variables *variables) {
+	if (!input.empty())
+		return lookup(input[0]->generate(variables));
+	syntax_assert(variables);
+	return lookup(variables->values[GENERATOR_VARIABLE_TIME]);
+}
+
+void Generator_trace::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i;
+	double *x;
+
+	if (input.empty()) {
+		Generator::generate_n(variables, values, n);
+		return;
+	}
+
+	x = generate_input(variables, n);
+	for (i = 0; i < n; i++)
+		values[i] = lookup(x[i]);
 }
 
 Generator_wave_pulse::Generator_wave_pulse(const vector<Generator *> *input):
@@ -228,8 +1055,25 @@ double Generator_sum::generate(const Generator_variables *variables) {
 	return sum;
 }
 
+void Generator_sum::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i, j;
+	double *x = generate_input(variables, n);
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < input.size(); j++)
+			sum += x[j * n + i];
+		values[i] = sum;
+	}
+}
+
+void Generator_sum::compile(Generator_program *program) {
+	compile_input(program);
+	program->add_sum(input.size());
+}
+
 Generator_multiply::Generator_multiply(const vector<Generator *> *input):
 	Generator(input) {
+	set_constant_input();
 }
 
 double Generator_multiply::generate(const Generator_variables *variables) {
@@ -241,8 +1085,26 @@ double Generator_multiply::generate(const Generator_variables *variables) {
 	return x;
 }
 
+void Generator_multiply::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i, j;
+	double *x = generate_input(variables, n);
+
+	for (i = 0; i < n; i++)
+		values[i] = 1.0;
+	for (j = 0; j < input.size(); j++) {
+		for (i = 0; i < n; i++)
+			values[i] *= x[j * n + i];
+	}
+}
+
+void Generator_multiply::compile(Generator_program *program) {
+	compile_input(program);
+	program->add_instruction(GENERATOR_OP_MULTIPLY, input.size(), 0.0);
+}
+
 Generator_add::Generator_add(const vector<Generator *> *input):
 	Generator(input) {
+	set_constant_input();
 }
 
 double Generator_add::generate(const Generator_variables *variables) {
@@ -254,9 +1116,27 @@ double Generator_add::generate(const Generator_variables *variables) {
 	return x;
 }
 
+void Generator_add::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i, j;
+	double *x = generate_input(variables, n);
+
+	for (i = 0; i < n; i++)
+		values[i] = 0.0;
+	for (j = 0; j < input.size(); j++) {
+		for (i = 0; i < n; i++)
+			values[i] += x[j * n + i];
+	}
+}
+
+void Generator_add::compile(Generator_program *program) {
+	compile_input(program);
+	program->add_instruction(GENERATOR_OP_ADD, input.size(), 0.0);
+}
+
 Generator_modulo::Generator_modulo(const vector<Generator *> *input):
 	Generator(input) {
 	syntax_assert(input && input->size() > 0);
+	set_constant_input();
 }
 
 double Generator_modulo::generate(const Generator_variables *variables) {
@@ -269,9 +1149,27 @@ double Generator_modulo::generate(const Generator_variables *variables) {
 	return x;
 }
 
+void Generator_modulo::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i, j;
+	double *x = generate_input(variables, n);
+
+	for (i = 0; i < n; i++)
+		values[i] = x[i];
+	for (j = 1; j < input.size(); j++) {
+		for (i = 0; i < n; i++)
+			values[i] = fmod(values[i], x[j * n + i]);
+	}
+}
+
+void Generator_modulo::compile(Generator_program *program) {
+	compile_input(program);
+	program->add_instruction(GENERATOR_OP_MODULO, input.size(), 0.0);
+}
+
 Generator_equal::Generator_equal(const vector<Generator *> *input):
 	Generator(input) {
 	syntax_assert(input && input->size() > 0);
+	set_constant_input();
 }
 
 double Generator_equal::generate(const Generator_variables *variables) {
@@ -289,9 +1187,15 @@ double Generator_equal::generate(const Generator_variables *variables) {
 	return max - min <= epsilon ? 1.0 : 0.0;
 }
 
+void Generator_equal::compile(Generator_program *program) {
+	compile_input(program);
+	program->add_instruction(GENERATOR_OP_EQUAL, input.size(), 0.0);
+}
+
 Generator_max::Generator_max(const vector<Generator *> *input):
 	Generator(input) {
 	syntax_assert(input && input->size() > 0);
+	set_constant_input();
 }
 
 double Generator_max::generate(const Generator_variables *variables) {
@@ -307,9 +1211,29 @@ double Generator_max::generate(const Generator_variables *variables) {
 	return max;
 }
 
+void Generator_max::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i, j;
+	double *x = generate_input(variables, n);
+
+	for (i = 0; i < n; i++)
+		values[i] = x[i];
+	for (j = 1; j < input.size(); j++) {
+		for (i = 0; i < n; i++) {
+			if (values[i] < x[j * n + i])
+				values[i] = x[j * n + i];
+		}
+	}
+}
+
+void Generator_max::compile(Generator_program *program) {
+	compile_input(program);
+	program->add_instruction(GENERATOR_OP_MAX, input.size(), 0.0);
+}
+
 Generator_min::Generator_min(const vector<Generator *> *input):
 	Generator(input) {
 	syntax_assert(input && input->size() > 0);
+	set_constant_input();
 }
 
 double Generator_min::generate(const Generator_variables *variables) {
@@ -325,18 +1249,241 @@ double Generator_min::generate(const Generator_variables *variables) {
 	return min;
 }
 
+void Generator_min::generate_n(const Generator_variables *variables, double *values, unsigned int n) {
+	unsigned int i, j;
+	double *x = generate_input(variables, n);
+
+	for (i = 0; i < n; i++)
+		values[i] = x[i];
+	for (j = 1; j < input.size(); j++) {
+		for (i = 0; i < n; i++) {
+			if (values[i] > x[j * n + i])
+				values[i] = x[j * n + i];
+		}
+	}
+}
+
+void Generator_min::compile(Generator_program *program) {
+	compile_input(program);
+	program->add_instruction(GENERATOR_OP_MIN, input.size(), 0.0);
+}
+
+Generator_program::Generator_program(const vector<Generator *> *input):
+	Generator(input) {
+	syntax_assert(input && input->size() == 1);
+	constant = (*input)[0]->is_constant();
+	depth = 0;
+	(*input)[0]->compile(this);
+	assert(depth == 1);
+}
+
+void Generator_program::add_instruction(Generator_opcode op, unsigned int inputs, double value) {
+	Generator_instruction instruction;
+
+	instruction.op = op;
+	instruction.inputs = inputs;
+	instruction.index = 0;
+	instruction.value = value;
+	instructions.push_back(instruction);
+
+	assert(depth >= inputs);
+	depth += 1 - inputs;
+	if (stack.size() < depth)
+		stack.resize(depth);
+}
+
+void Generator_program::add_variable(Generator_variable_index index) {
+	add_instruction(GENERATOR_OP_VARIABLE, 0, 0.0);
+	instructions.back().index = index;
+}
+
+void Generator_program::add_call(Generator *generator) {
+	add_instruction(GENERATOR_OP_CALL, 0, 0.0);
+	instructions.back().index = calls.size();
+	calls.push_back(generator);
+}
+
+void Generator_program::add_random(Generator_opcode op, Generator_random_stream *stream) {
+	add_instruction(op, 0, 0.0);
+	instructions.back().index = streams.size();
+	streams.push_back(stream);
+}
+
+void Generator_program::add_sum(unsigned int inputs) {
+	add_instruction(GENERATOR_OP_SUM, inputs, 0.0);
+	instructions.back().index = sums.size();
+	sums.push_back(0.0);
+}
+
+double Generator_program::generate(const Generator_variables *variables) {
+	const Generator_instruction *ins, *end;
+	double *sp, x, y, min, max;
+	unsigned int i, n;
+
+	sp = &stack[0];
+
+	for (ins = &instructions[0], end = ins + instructions.size(); ins < end; ins++) {
+		n = ins->inputs;
+
+		switch (ins->op) {
+			case GENERATOR_OP_FLOAT:
+				x = ins->value;
+				break;
+			case GENERATOR_OP_VARIABLE:
+				syntax_assert(variables);
+				x = variables->values[ins->index];
+				break;
+			case GENERATOR_OP_UNIFORM:
+				x = streams[ins->index]->uniform();
+				break;
+			case GENERATOR_OP_NORMAL:
+				x = streams[ins->index]->normal();
+				break;
+			case GENERATOR_OP_EXPONENTIAL:
+				x = streams[ins->index]->exponential();
+				break;
+			case GENERATOR_OP_CALL:
+				x = calls[ins->index]->generate(variables);
+				break;
+			case GENERATOR_OP_SUM:
+				sp -= n;
+				x = sums[ins->index];
+				for (i = 0; i < n; i++)
+					x += sp[i];
+				sums[ins->index] = x;
+				break;
+			case GENERATOR_OP_MULTIPLY:
+				sp -= n;
+				for (i = 0, x = 1.0; i < n; i++)
+					x *= sp[i];
+				break;
+			case GENERATOR_OP_ADD:
+				sp -= n;
+				for (i = 0, x = 0.0; i < n; i++)
+					x += sp[i];
+				break;
+			case GENERATOR_OP_MODULO:
+				sp -= n;
+				for (i = 1, x = sp[0]; i < n; i++)
+					x = fmod(x, sp[i]);
+				break;
+			case GENERATOR_OP_EQUAL:
+				sp -= n;
+				for (i = 1, min = max = 0.0; i < n; i++) {
+					y = sp[i];
+					if (i == 1 || min > y)
+						min = y;
+					if (i == 1 || max < y)
+						max = y;
+				}
+				x = max - min <= sp[0] ? 1.0 : 0.0;
+				break;
+			case GENERATOR_OP_MAX:
+				sp -= n;
+				for (i = 0, x = 0.0; i < n; i++) {
+					if (!i || x < sp[i])
+						x = sp[i];
+				}
+				break;
+			case GENERATOR_OP_MIN:
+				sp -= n;
+				for (i = 0, x = 0.0; i < n; i++) {
+					if (!i || x > sp[i])
+						x = sp[i];
+				}
+				break;
+			default:
+				assert(0);
+		}
+
+		*sp++ = x;
+	}
+
+	assert(sp == &stack[0] + 1);
+
+	return stack[0];
+}
+
+Generator_buffer::Generator_buffer() {
+	generator = NULL;
+	index = GENERATOR_BLOCK_SIZE;
+}
+
+Generator_buffer::~Generator_buffer() {
+	if (generator)
+		delete generator;
+}
+
+void Generator_buffer::set_generator(Generator *generator) {
+	if (this->generator)
+		delete this->generator;
+	this->generator = generator;
+	index = GENERATOR_BLOCK_SIZE;
+}
+
+bool Generator_buffer::has_generator() const {
+	return generator != NULL;
+}
+
+double Generator_buffer::next() {
+	assert(generator);
+	if (index >= GENERATOR_BLOCK_SIZE) {
+		generator->generate_n(NULL, values, GENERATOR_BLOCK_SIZE);
+		index = 0;
+	}
+	return values[index++];
+}
+
 Generator_generator::Generator_generator() {
 }
 
 Generator_generator::~Generator_generator() {
+	map<string, Generator *>::iterator iter;
+
+	for (iter = shared.begin(); iter != shared.end(); iter++)
+		iter->second->unreference();
+}
+
+Generator *Generator_generator::generate(char *code) {
+	string key;
+
+	/* the returned generator is never shared */
+	return parse(code, &key);
 }
 
-Generator *Generator_generator::generate(char *code) const {
+/* return a previously parsed generator with the same key instead of the new
+   one, generators with empty key are not deterministic and can't be shared */
+Generator *Generator_generator::share(Generator *generator, const string &key) {
+	map<string, Generator *>::iterator iter;
+
+	if (key.empty())
+		return generator;
+
+	iter = shared.find(key);
+	if (iter == shared.end()) {
+		generator->reference();
+		shared[key] = generator;
+		return generator;
+	}
+
+	generator->unreference();
+	iter->second->reference();
+
+	return iter->second;
+}
+
+/* parse the expression and set the key to a string identifying it if it is
+   deterministic */
+Generator *Generator_generator::parse(char *code, string *key) {
 	const char *ws = " \t\n\r", *wsp = " \t\n\r()";
 	int len, paren;
 	Generator *ret;
 	vector<Generator *> generators;
-	char *arg, *name, *end, *string = NULL;
+	char *arg, *name, *end, *string = NULL, buf[32];
+	bool deterministic = true;
+	std::string arg_key;
+
+	key->clear();
 
 	//printf("code: |%s|\n", code);
 	len = strlen(code);
@@ -361,6 +1508,7 @@ Generator *Generator_generator::generate(char *code) const {
 
 	while (code < end) {
 		arg = code;
+		arg_key.clear();
 
 		if (arg[0] == '(') {
 			code = ++arg;
@@ -378,7 +1526,7 @@ Generator *Generator_generator::generate(char *code) const {
 			code++;
 
 			//printf("generator: %s\n", arg);
-			generators.push_back(generate(arg));
+			generators.push_back(parse(arg, &arg_key));
 			syntax_assert(generators.back());
 		} else if (arg[0] == '"') {
 			string = code = ++arg;
@@ -394,16 +1542,30 @@ Generator *Generator_generator::generate(char *code) const {
 			code++;
 			if (isalpha(arg[0])) {
 				generators.push_back(new Generator_variable(arg));
+				arg_key = arg;
 				//printf("variable: %s\n", arg);
 			} else {
 				generators.push_back(new Generator_float(atof(arg)));
+				snprintf(buf, sizeof (buf), "%a", atof(arg));
+				arg_key = buf;
 				//printf("float: %f\n", generators.back()->generate());
 			}
 		}
 
+		if (arg_key.empty())
+			deterministic = false;
+		else
+			generators.back() = share(generators.back(), arg_key);
+		*key += " " + arg_key;
+
 		code += strspn(code, ws);
 	}
 
+	if (string ||
+			(strcmp(name, "*") && strcmp(name, "+") && strcmp(name, "%") &&
+			 strcmp(name, "equal") && strcmp(name, "max") && strcmp(name, "min")))
+		deterministic = false;
+
 	if (strcmp(name, "*") == 0)
 		ret = new Generator_multiply(&generators);
 	else if (strcmp(name, "+") == 0)
@@ -420,8 +1582,12 @@ Generator *Generator_generator::generate(char *code) const {
 		ret = new Generator_random_exponential(&generators);
 	else if (strcmp(name, "poisson") == 0)
 		ret = new Generator_random_poisson(&generators);
+	else if (strcmp(name, "powerlaw") == 0)
+		ret = new Generator_random_powerlaw(&generators);
 	else if (strcmp(name, "file") == 0)
 		ret = new Generator_file(string);
+	else if (strcmp(name, "trace") == 0)
+		ret = new Generator_trace(string, &generators);
 	else if (strcmp(name, "pulse") == 0)
 		ret = new Generator_wave_pulse(&generators);
 	else if (strcmp(name, "sine") == 0)
@@ -436,10 +1602,26 @@ Generator *Generator_generator::generate(char *code) const {
 		ret = new Generator_max(&generators);
 	else if (strcmp(name, "min") == 0)
 		ret = new Generator_min(&generators);
+	else if (strcmp(name, "compile") == 0)
+		ret = new Generator_program(&generators);
 	else {
 		ret = NULL;
 		syntax_assert(0);
 	}
 
+	/* replace constant expressions with their value */
+	if (ret->is_constant()) {
+		double x = ret->generate(NULL);
+
+		ret->unreference();
+		ret = new Generator_float(x);
+		snprintf(buf, sizeof (buf), "%a", x);
+		*key = buf;
+	} else if (deterministic) {
+		*key = "(" + std::string(name) + *key + ")";
+	} else {
+		key->clear();
+	}
+
 	return ret;
 }
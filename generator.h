@@ -25,18 +25,87 @@
 
 using namespace std;
 
-typedef map<string, double> Generator_variables;
+/* variables available in network delay expressions */
+enum Generator_variable_index {
+	GENERATOR_VARIABLE_TIME,
+	GENERATOR_VARIABLE_FROM,
+	GENERATOR_VARIABLE_TO,
+	GENERATOR_VARIABLE_SUBNET,
+	GENERATOR_VARIABLE_PORT,
+	GENERATOR_VARIABLE_LENGTH,
+	GENERATOR_VARIABLES
+};
+
+struct Generator_variables {
+	double values[GENERATOR_VARIABLES];
+};
+
+#define GENERATOR_BLOCK_SIZE 64
+
+class Generator_program;
+struct Generator_random_ring;
+
+enum Generator_distribution {
+	GENERATOR_DISTRIBUTION_UNIFORM,
+	GENERATOR_DISTRIBUTION_NORMAL,
+	GENERATOR_DISTRIBUTION_EXPONENTIAL,
+};
+
+/* xoshiro256** generator, each random generator has its own stream derived
+   from the seed and the order in which the generators were created. With
+   the producer thread enabled, the numbers are generated by the thread from
+   a copy of the stream into a ring buffer, which is created on the first
+   use of the stream (each stream has only one distribution). */
+class Generator_random_stream {
+	uint64_t state[4];
+	Generator_random_ring *ring;
+	bool direct;
+
+	static uint64_t seed;
+	static uint64_t streams;
+	static bool ziggurat;
+	static bool producer;
+
+	double normal_tail(int64_t hz, unsigned int iz);
+	double exponential_tail(uint32_t jz, unsigned int iz);
+	double pop(Generator_distribution distribution);
+
+	public:
+	Generator_random_stream();
+	~Generator_random_stream();
+	uint64_t next();
+	double uniform();
+	double normal();
+	double exponential();
+	double generate(Generator_distribution distribution);
+	static void set_seed(uint64_t seed);
+	static void set_ziggurat(bool enable);
+	static void set_producer(bool enable);
+};
 
 class Generator {
+	unsigned int references;
+
 	protected:
 	vector<Generator *> input;
 	bool constant;
 
+	/* blocks of values generated by the inputs */
+	vector<double> buffer;
+
+	void compile_input(Generator_program *program);
+	void set_constant_input();
+	double *generate_input(const Generator_variables *variables, unsigned int n);
+
 	public:
 	Generator(const vector<Generator *> *input);
 	virtual ~Generator();
 	virtual double generate(const Generator_variables *variables) = 0;
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
 	bool is_constant() const;
+	void reference();
+	void unreference();
 };
 
 class Generator_float: public Generator {
@@ -45,54 +114,137 @@ class Generator_float: public Generator {
 	public:
 	Generator_float(double f);
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
 };
 
 class Generator_variable: public Generator {
-	string name;
+	Generator_variable_index index;
 
 	public:
 	Generator_variable(string name);
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
 };
 
 class Generator_random_uniform: public Generator {
+	Generator_random_stream random;
+
 	public:
 	Generator_random_uniform(const vector<Generator *> *input);
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
 };
 
 class Generator_random_normal: public Generator {
-	Generator_random_uniform uniform;
+	Generator_random_stream random;
 
 	public:
 	Generator_random_normal(const vector<Generator *> *input);
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
 };
 
 class Generator_random_exponential: public Generator {
-	Generator_random_uniform uniform;
+	Generator_random_stream random;
 
 	public:
 	Generator_random_exponential(const vector<Generator *> *input);
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
 };
 
+/* small lambda uses the multiplication of uniform numbers, large lambda
+   uses the transformed rejection with squeeze (PTRS) by Hormann */
 class Generator_random_poisson: public Generator {
-	Generator_random_uniform uniform;
+	Generator_random_stream random;
+	double lambda;
 	double L;
+	double log_lambda, a, b, inv_alpha, v_r;
 
 	public:
 	Generator_random_poisson(const vector<Generator *> *input);
 	virtual double generate(const Generator_variables *variables);
 };
 
+#define GENERATOR_POWERLAW_ROWS 32
+
+/* noise with power spectral density proportional to 1/f^alpha generated by
+   the Voss-McCartney algorithm, rows of held random values are updated
+   with periods increasing in powers of two and their amplitude is scaled
+   for the slope of the spectrum */
+class Generator_random_powerlaw: public Generator {
+	Generator_random_stream random;
+	double scale[GENERATOR_POWERLAW_ROWS];
+	double rows[GENERATOR_POWERLAW_ROWS];
+	double sum;
+	uint64_t counter;
+
+	public:
+	Generator_random_powerlaw(const vector<Generator *> *input);
+	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+};
+
+/* binary trace files start with the magic followed by doubles in the native
+   byte order */
+#define GENERATOR_TRACE_MAGIC "CNSTRACE"
+#define GENERATOR_TRACE_MAGIC_LEN 8
+
+/* values from a trace file mapped to memory, which are shared by all
+   generators using the same file. Text files are converted to the binary
+   format and the result is cached in a file with the .bin suffix. */
+class Generator_trace_data {
+	string name;
+	unsigned int references;
+	void *data;
+	size_t data_size;
+	vector<double> converted;
+	const double *values;
+	size_t size;
+
+	static map<string, Generator_trace_data *> files;
+
+	Generator_trace_data(const string &name);
+	~Generator_trace_data();
+	bool map_binary(const char *file);
+	bool convert_text(const char *file, const char *cache);
+
+	public:
+	static Generator_trace_data *open(const char *file);
+	void close();
+	const double *get_values() const;
+	size_t get_size() const;
+};
+
 class Generator_file: public Generator {
-	FILE *input;
+	Generator_trace_data *trace;
+	size_t index;
 
 	public:
 	Generator_file(const char *file);
 	virtual ~Generator_file();
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+};
+
+/* generator interpolating values from a trace of (time, value) pairs sorted
+   by time, at the time of the event or the value of the input */
+class Generator_trace: public Generator {
+	Generator_trace_data *trace;
+	size_t index;
+
+	double lookup(double x);
+
+	public:
+	Generator_trace(const char *file, const vector<Generator *> *input);
+	virtual ~Generator_trace();
+	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
 };
 
 class Generator_wave_pulse: public Generator {
@@ -137,49 +289,127 @@ class Generator_sum: public Generator {
 	public:
 	Generator_sum(const vector<Generator *> *input);
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
 };
 
 class Generator_multiply: public Generator {
 	public:
 	Generator_multiply(const vector<Generator *> *input);
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
 };
 
 class Generator_add: public Generator {
 	public:
 	Generator_add(const vector<Generator *> *input);
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
 };
 
 class Generator_modulo: public Generator {
 	public:
 	Generator_modulo(const vector<Generator *> *input);
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
 };
 
 class Generator_equal: public Generator {
 	public:
 	Generator_equal(const vector<Generator *> *input);
 	virtual double generate(const Generator_variables *variables);
+	virtual void compile(Generator_program *program);
 };
 
 class Generator_max: public Generator {
 	public:
 	Generator_max(const vector<Generator *> *input);
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
 };
 
 class Generator_min: public Generator {
 	public:
 	Generator_min(const vector<Generator *> *input);
 	virtual double generate(const Generator_variables *variables);
+	virtual void generate_n(const Generator_variables *variables, double *values, unsigned int n);
+	virtual void compile(Generator_program *program);
+};
+
+enum Generator_opcode {
+	GENERATOR_OP_FLOAT,
+	GENERATOR_OP_VARIABLE,
+	GENERATOR_OP_UNIFORM,
+	GENERATOR_OP_NORMAL,
+	GENERATOR_OP_EXPONENTIAL,
+	GENERATOR_OP_CALL,
+	GENERATOR_OP_SUM,
+	GENERATOR_OP_MULTIPLY,
+	GENERATOR_OP_ADD,
+	GENERATOR_OP_MODULO,
+	GENERATOR_OP_EQUAL,
+	GENERATOR_OP_MAX,
+	GENERATOR_OP_MIN,
+};
+
+struct Generator_instruction {
+	Generator_opcode op;
+	unsigned int inputs;
+	unsigned int index; /* index of variable, call, sum or random stream */
+	double value;
+};
+
+/* expression compiled into instructions for a stack machine, it evaluates
+   the inputs in the same order as the tree of generators */
+class Generator_program: public Generator {
+	vector<Generator_instruction> instructions;
+	vector<Generator *> calls;
+	vector<double> sums;
+	vector<Generator_random_stream *> streams;
+	vector<double> stack;
+	unsigned int depth;
+
+	public:
+	Generator_program(const vector<Generator *> *input);
+	virtual double generate(const Generator_variables *variables);
+	void add_instruction(Generator_opcode op, unsigned int inputs, double value);
+	void add_variable(Generator_variable_index index);
+	void add_call(Generator *generator);
+	void add_sum(unsigned int inputs);
+	void add_random(Generator_opcode op, Generator_random_stream *stream);
 };
 
+/* values of a generator evaluated without variables, which are generated
+   in blocks and returned one at a time */
+class Generator_buffer {
+	Generator *generator;
+	double values[GENERATOR_BLOCK_SIZE];
+	unsigned int index;
+
+	public:
+	Generator_buffer();
+	~Generator_buffer();
+	void set_generator(Generator *generator);
+	bool has_generator() const;
+	double next();
+};
+
+/* parser of expressions, constant subexpressions are replaced with their
+   value and identical deterministic subexpressions are shared */
 class Generator_generator {
+	map<string, Generator *> shared;
+
+	Generator *parse(char *code, string *key);
+	Generator *share(Generator *generator, const string &key);
+
 	public:
 	Generator_generator();
 	~Generator_generator();
-	Generator *generate(char *code) const;
+	Generator *generate(char *code);
 };
 
 #endif
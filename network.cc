@@ -18,17 +18,135 @@
 #include "sysheaders.h"
 #include "network.h"
 
-Packet_queue::Packet_queue() {
+#include <algorithm>
+
+Packet_pool::Packet_pool() {
+	allocations = 0;
+	payload_allocations = 0;
+	in_use = 0;
+	max_in_use = 0;
+	allocated_memory = 0;
 }
 
-Packet_queue::~Packet_queue() {
-	while (!queue.empty()) {
-		delete queue.back();
-		queue.pop_back();
+Packet_pool::~Packet_pool() {
+	while (!slabs.empty()) {
+		delete[] slabs.back();
+		slabs.pop_back();
+	}
+}
+
+unsigned int Packet_pool::get_size_class(unsigned int len) {
+	unsigned int c;
+
+	for (c = 0; (1U << (c + PACKET_POOL_MIN_SHIFT)) < len; c++)
+		;
+	assert(c < PACKET_POOL_CLASSES);
+
+	return c;
+}
+
+char *Packet_pool::alloc_slab(unsigned int size) {
+	slabs.push_back(new char[size]);
+	allocated_memory += size;
+	return slabs.back();
+}
+
+struct Packet *Packet_pool::alloc_header() {
+	struct Packet *packet;
+	unsigned int i;
+	char *slab;
+
+	if (free_packets.empty()) {
+		slab = alloc_slab(PACKET_POOL_SLAB_SIZE);
+		for (i = 0; i + sizeof (struct Packet) <= PACKET_POOL_SLAB_SIZE;
+				i += sizeof (struct Packet))
+			free_packets.push_back((struct Packet *)(slab + i));
+	}
+
+	packet = free_packets.back();
+	free_packets.pop_back();
+
+	allocations++;
+	in_use++;
+	if (max_in_use < in_use)
+		max_in_use = in_use;
+
+	return packet;
+}
+
+struct Packet *Packet_pool::alloc(unsigned int len) {
+	struct Packet *packet;
+	struct Packet_payload *payload;
+	unsigned int i, c, size;
+	char *slab;
+
+	assert(len <= MAX_PACKET_SIZE);
+
+	c = get_size_class(offsetof(struct Packet_payload, data) + len);
+
+	if (free_payloads[c].empty()) {
+		size = 1U << (c + PACKET_POOL_MIN_SHIFT);
+		slab = alloc_slab(PACKET_POOL_SLAB_SIZE);
+		for (i = 0; i + size <= PACKET_POOL_SLAB_SIZE; i += size)
+			free_payloads[c].push_back((struct Packet_payload *)(slab + i));
 	}
+
+	payload = free_payloads[c].back();
+	free_payloads[c].pop_back();
+	payload->references = 1;
+	payload->size_class = c;
+	payload_allocations++;
+
+	packet = alloc_header();
+	packet->payload = payload;
+	packet->data = payload->data;
+	packet->len = len;
+
+	return packet;
+}
+
+struct Packet *Packet_pool::clone(const struct Packet *packet) {
+	struct Packet *ret;
+
+	ret = alloc_header();
+	*ret = *packet;
+	ret->payload->references++;
+
+	return ret;
+}
+
+void Packet_pool::free(struct Packet *packet) {
+	struct Packet_payload *payload = packet->payload;
+
+	assert(payload->references > 0);
+	if (--payload->references == 0)
+		free_payloads[payload->size_class].push_back(payload);
+
+	free_packets.push_back(packet);
+	assert(in_use > 0);
+	in_use--;
+}
+
+void Packet_pool::print(int verbosity) const {
+	if (verbosity <= 1)
+		return;
+
+	printf("Packet allocations:                    \t%lu\n", allocations);
+	printf("Payload allocations:                   \t%lu\n", payload_allocations);
+	printf("Maximum packets in use:                \t%lu\n", max_in_use);
+	printf("Allocated packet memory:               \t%lu\n", allocated_memory);
+}
+
+Packet_queue::~Packet_queue() {
+}
+
+Packet_queue_list::Packet_queue_list() {
+}
+
+Packet_queue_list::~Packet_queue_list() {
 }
 
-void Packet_queue::insert(struct Packet *packet) {
+void Packet_queue_list::insert(struct Packet *packet) {
 	deque<struct Packet *>::iterator i;
 
 	for (i = queue.begin(); i < queue.end(); i++)
@@ -37,7 +155,7 @@ void Packet_queue::insert(struct Packet *packet) {
 	queue.insert(i, packet);
 }
 
-struct Packet *Packet_queue::dequeue() {
+struct Packet *Packet_queue_list::dequeue() {
 	struct Packet *ret;
 
 	assert(!queue.empty());
@@ -47,14 +165,163 @@ struct Packet *Packet_queue::dequeue() {
 	return ret;
 }
 
-double Packet_queue::get_timeout(double time) const {
+double Packet_queue_list::get_timeout(Sim_time time) const {
 	if (!queue.empty()) {
 		return queue[0]->receive_time - time;
 	}
 	return 1e20;
 }
 
-Network::Network(const char *socket, unsigned int n, unsigned int subnets, unsigned int rate) {
+bool Packet_queue_list::empty() const {
+	return queue.empty();
+}
+
+/* ordering of the heap, packets with equal receive time are kept in the
+   order in which they were inserted */
+static bool packet_entry_later(const Packet_queue_entry &a, const Packet_queue_entry &b) {
+	if (a.receive_time != b.receive_time)
+		return a.receive_time > b.receive_time;
+	return a.sequence > b.sequence;
+}
+
+Packet_queue_heap::Packet_queue_heap() {
+	sequence = 0;
+}
+
+Packet_queue_heap::~Packet_queue_heap() {
+}
+
+void Packet_queue_heap::insert(struct Packet *packet) {
+	Packet_queue_entry entry;
+
+	entry.receive_time = packet->receive_time;
+	entry.sequence = sequence++;
+	entry.packet = packet;
+
+	heap.push_back(entry);
+	push_heap(heap.begin(), heap.end(), packet_entry_later);
+}
+
+struct Packet *Packet_queue_heap::dequeue() {
+	struct Packet *ret;
+
+	assert(!heap.empty());
+	pop_heap(heap.begin(), heap.end(), packet_entry_later);
+	ret = heap.back().packet;
+	heap.pop_back();
+
+	return ret;
+}
+
+double Packet_queue_heap::get_timeout(Sim_time time) const {
+	if (!heap.empty()) {
+		return heap[0].receive_time - time;
+	}
+	return 1e20;
+}
+
+bool Packet_queue_heap::empty() const {
+	return heap.empty();
+}
+
+Wakeup_queue::Wakeup_queue(unsigned int nodes) {
+	times.resize(nodes);
+	positions.resize(nodes, -1);
+}
+
+Wakeup_queue::~Wakeup_queue() {
+}
+
+bool Wakeup_queue::earlier(unsigned int node1, unsigned int node2) const {
+	if (times[node1] != times[node2])
+		return times[node1] < times[node2];
+	return node1 < node2;
+}
+
+void Wakeup_queue::move(unsigned int node, unsigned int position) {
+	heap[position] = node;
+	positions[node] = position;
+}
+
+void Wakeup_queue::sift_up(unsigned int position) {
+	unsigned int node = heap[position], parent;
+
+	while (position > 0) {
+		parent = (position - 1) / 2;
+		if (!earlier(node, heap[parent]))
+			break;
+		move(heap[parent], position);
+		position = parent;
+	}
+	move(node, position);
+}
+
+void Wakeup_queue::sift_down(unsigned int position) {
+	unsigned int node = heap[position], child, n = heap.size();
+
+	while ((child = 2 * position + 1) < n) {
+		if (child + 1 < n && earlier(heap[child + 1], heap[child]))
+			child++;
+		if (!earlier(heap[child], node))
+			break;
+		move(heap[child], position);
+		position = child;
+	}
+	move(node, position);
+}
+
+void Wakeup_queue::set(unsigned int node, Sim_time time) {
+	assert(node < times.size());
+
+	times[node] = time;
+
+	if (positions[node] < 0) {
+		heap.push_back(node);
+		positions[node] = heap.size() - 1;
+	}
+
+	sift_up(positions[node]);
+	sift_down(positions[node]);
+}
+
+void Wakeup_queue::remove(unsigned int node) {
+	unsigned int position, last;
+
+	assert(node < times.size());
+
+	if (positions[node] < 0)
+		return;
+
+	position = positions[node];
+	positions[node] = -1;
+	last = heap.back();
+	heap.pop_back();
+
+	if (last == node)
+		return;
+
+	move(last, position);
+	sift_up(position);
+	sift_down(positions[last]);
+}
+
+bool Wakeup_queue::empty() const {
+	return heap.empty();
+}
+
+unsigned int Wakeup_queue::get_first() const {
+	assert(!heap.empty());
+	return heap[0];
+}
+
+Sim_time Wakeup_queue::get_first_time() const {
+	if (!heap.empty())
+		return times[heap[0]];
+	return 1e20;
+}
+
+Network::Network(const char *socket, unsigned int n, unsigned int subnets, unsigned int rate):
+	wakeup_queue(n), clock_bank(n) {
        	time = 0.0;
 	this->subnets = subnets;
 	socket_name = socket;
@@ -64,6 +331,12 @@ Network::Network(const char *socket, unsigned int n, unsigned int subnets, unsig
 	freq_log = NULL;
 	rawfreq_log = NULL;
 	packet_log = NULL;
+	packet_queue = new Packet_queue_heap();
+	epoll_fd = -1;
+	shm_transport = false;
+	batching_updates = false;
+	deferring_requests = false;
+	blocked_nodes = 0;
 
 	assert(n > 0);
 
@@ -72,6 +345,7 @@ Network::Network(const char *socket, unsigned int n, unsigned int subnets, unsig
 
 	stats.resize(n);
 	link_delays.resize(n * n);
+	request_rounds.resize(n);
 }
 
 Network::~Network() {
@@ -85,8 +359,15 @@ Network::~Network() {
 		link_delays.pop_back();
 	}
 
+	while (!packet_queue->empty())
+		free_packet(packet_queue->dequeue());
+	delete packet_queue;
+
 	unlink(socket_name);
 
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+
 	if (offset_log)
 		fclose(offset_log);
 	if (freq_log)
@@ -142,16 +423,39 @@ bool Network::prepare_clients() {
 		node = req.data._register.node;
 		assert(node < nodes.size() && nodes[node]->get_fd() < 0);
 		nodes[node]->set_fd(fd);
+
+		/* epoll can wait only for requests received from the sockets */
+		if (shm_transport && epoll_fd < 0 &&
+				req.data._register.transport == TRANSPORT_SHM)
+			nodes[node]->enable_shm_transport();
 	}
 	fprintf(stderr, "done\n");
 
 	close(sockfd);
 
+	if (epoll_fd >= 0) {
+		for (i = 0; i < nodes.size(); i++) {
+			struct epoll_event event;
+
+			event.events = EPOLLIN;
+			event.data.u32 = i;
+			if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, nodes[i]->get_fd(), &event) < 0) {
+				fprintf(stderr, "epoll_ctl() failed\n");
+				return false;
+			}
+		}
+		epoll_events.resize(nodes.size());
+	}
+
 	update();
 
 	return true;
 }
 
+Clock_bank *Network::get_clock_bank() {
+	return &clock_bank;
+}
+
 Node *Network::get_node(unsigned int node) {
 	assert(node < nodes.size());
 	return nodes[node];
@@ -168,42 +472,77 @@ void Network::set_link_delay_generator(unsigned int from, unsigned int to, Gener
 	link_delays[i] = generator;
 }
 
-bool Network::run(double time_limit) {
-	int i, n = nodes.size(), waiting;
-	bool pending_update;
-	double min_timeout, timeout, next_update;
+void Network::set_packet_queue(Packet_queue *queue) {
+	delete packet_queue;
+	packet_queue = queue;
+}
+
+void Network::set_epoll(bool enable) {
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	epoll_fd = enable ? epoll_create1(0) : -1;
+	if (enable && epoll_fd < 0) {
+		fprintf(stderr, "epoll_create1() failed\n");
+		exit(1);
+	}
+}
+
+void Network::set_shm_transport(bool enable) {
+	shm_transport = enable;
+}
+
+void Network::set_update_batching(bool enable) {
+	batching_updates = enable;
+}
+
+bool Network::run(Sim_time time_limit) {
+	int i, n = nodes.size(), wakeup_node;
+	unsigned int j, batched_updates;
+	bool pending_update, batch_checked;
+	double min_timeout, timeout;
+	Sim_time next_update;
+	vector<unsigned int> awake, expired;
+
+	for (i = 0; i < n; i++) {
+		if (nodes[i]->waiting())
+			update_wakeup(i);
+		else
+			awake.push_back(i);
+	}
 
 	while (time < time_limit) {
-		for (i = 0, waiting = 0; i < n; i++)
-			if (nodes[i]->waiting())
-				waiting++;
-			else 
-				stats[i].update_wakeup_stats();
+		sort(awake.begin(), awake.end());
 
-		while (waiting < n) {
-			for (i = 0; i < n; i++) {
-				if (nodes[i]->waiting())
-					continue;
-				if (!nodes[i]->process_fd()) {
-					fprintf(stderr, "client %d failed.\n", i + 1);
-					return false;
-				}
-				if (nodes[i]->waiting())
-					waiting++;
-			}
+		for (j = 0; j < awake.size(); j++)
+			stats[awake[j]].update_wakeup_stats();
+
+		if (epoll_fd >= 0) {
+			if (!collect_requests_epoll(awake))
+				return false;
+		} else {
+			if (!collect_requests(awake))
+				return false;
 		}
 
+		batch_checked = false;
+
 		do {
-			min_timeout = nodes[0]->get_timeout();
-			for (i = 1; i < n; i++) {
-				timeout = nodes[i]->get_timeout();
-				if (min_timeout > timeout)
-					min_timeout = timeout;
+			/* the queue is ordered by the wakeup times, but the
+			   timeout is calculated from the current state of the
+			   clock */
+			if (!wakeup_queue.empty()) {
+				wakeup_node = wakeup_queue.get_first();
+				min_timeout = nodes[wakeup_node]->get_timeout();
+			} else {
+				wakeup_node = -1;
+				min_timeout = 1e20;
 			}
 
-			timeout = packet_queue.get_timeout(time);
-			if (timeout <= min_timeout)
+			timeout = packet_queue->get_timeout(time);
+			if (timeout <= min_timeout) {
 				min_timeout = timeout;
+				wakeup_node = -1;
+			}
 
 			next_update = floor(time) + (double)(update_count + 1) / update_rate;
 			timeout = next_update - time;
@@ -216,32 +555,208 @@ bool Network::run(double time_limit) {
 			//min_timeout += 1e-12;
 			assert(min_timeout >= 0.0);
 
+			/* try to batch the updates once between other events */
+			if (pending_update && batching_updates && !batch_checked) {
+				batch_checked = true;
+				batched_updates = get_batchable_updates(next_update, time_limit);
+				if (batched_updates) {
+					batch_updates(next_update, batched_updates);
+					continue;
+				}
+			}
+
 			if (pending_update)
 				time = next_update;
 			else
 				time += min_timeout;
 
-			for (i = 0; i < n; i++)
-				nodes[i]->get_clock()->advance(min_timeout);
-
 			if (pending_update)
 				update();
 		} while (pending_update && time < time_limit);
 
-		for (i = 0; i < n; i++)
+		/* resume the node which timed out and any other nodes which
+		   should have timed out by now */
+		if (!pending_update && wakeup_node >= 0) {
+			expired.push_back(wakeup_node);
+			wakeup_queue.remove(wakeup_node);
+		}
+
+		while (!wakeup_queue.empty() && (wakeup_queue.get_first_time() <= time ||
+					nodes[wakeup_queue.get_first()]->get_timeout() <= 0.0)) {
+			expired.push_back(wakeup_queue.get_first());
+			wakeup_queue.remove(expired.back());
+		}
+
+		for (j = 0; j < expired.size(); j++) {
+			i = expired[j];
 			nodes[i]->resume();
+			if (nodes[i]->waiting())
+				update_wakeup(i);
+			else
+				awake.push_back(i);
+		}
+		expired.clear();
+
+		while (packet_queue->get_timeout(time) <= 0) {
+			assert(packet_queue->get_timeout(time) > -1e-10);
+			struct Packet *packet = packet_queue->dequeue();
+			bool waiting = nodes[packet->to]->waiting();
 
-		while (packet_queue.get_timeout(time) <= 0) {
-			assert(packet_queue.get_timeout(time) > -1e-10);
-			struct Packet *packet = packet_queue.dequeue();
 			stats[packet->to].update_packet_stats(true, time, packet->delay);
-			nodes[packet->to]->receive(packet);
+			i = packet->to;
+			if (!nodes[i]->receive(packet))
+				stats[i].update_filtered_packet_stats();
+
+			if (waiting && !nodes[i]->waiting()) {
+				wakeup_queue.remove(i);
+				awake.push_back(i);
+			}
+		}
+	}
+
+	return true;
+}
+
+/* process requests of the nodes which were woken up, one request per node
+   in each round in the order of their index */
+bool Network::collect_requests(vector<unsigned int> &awake) {
+	unsigned int i, j, k;
+
+	while (!awake.empty()) {
+		for (j = k = 0; j < awake.size(); j++) {
+			i = awake[j];
+			if (!nodes[i]->process_fd()) {
+				fprintf(stderr, "client %d failed.\n", i + 1);
+				return false;
+			}
+			if (nodes[i]->waiting())
+				update_wakeup(i);
+			else
+				awake[k++] = i;
+		}
+		awake.resize(k);
+	}
+
+	return true;
+}
+
+/* process requests of the nodes which were woken up in the order in which
+   they arrive. Requests which depend on the order of processing (sending
+   packets and generating reference clock offsets) are deferred until all
+   nodes are waiting or blocked in deferred requests and then processed in
+   the order of the rounds in which collect_requests() would process them,
+   so the results are the same as with collect_requests(). */
+bool Network::collect_requests_epoll(vector<unsigned int> &awake) {
+	unsigned int i, j, active;
+	int r;
+
+	for (j = 0; j < awake.size(); j++)
+		request_rounds[awake[j]] = 0;
+
+	active = awake.size();
+	blocked_nodes = 0;
+	deferring_requests = true;
+
+	while (active > 0) {
+		if (blocked_nodes == active) {
+			process_deferred_requests(false);
+			continue;
+		}
+
+		r = epoll_wait(epoll_fd, &epoll_events[0], epoll_events.size(), -1);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "epoll_wait() failed\n");
+			return false;
+		}
+
+		for (j = 0; j < (unsigned int)r; j++) {
+			i = epoll_events[j].data.u32;
+
+			if (nodes[i]->waiting()) {
+				/* finished client closed the connection */
+				assert(nodes[i]->finished());
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, nodes[i]->get_fd(), NULL);
+				continue;
+			}
+
+			if (!nodes[i]->process_fd()) {
+				fprintf(stderr, "client %d failed.\n", i + 1);
+				return false;
+			}
+			request_rounds[i]++;
+
+			if (nodes[i]->waiting()) {
+				update_wakeup(i);
+				active--;
+			}
+		}
+	}
+
+	process_deferred_requests(true);
+	deferring_requests = false;
+	awake.clear();
+
+	return true;
+}
+
+static bool deferred_request_earlier(const Deferred_request &a, const Deferred_request &b) {
+	if (a.round != b.round)
+		return a.round < b.round;
+	return a.node < b.node;
+}
+
+/* process the deferred requests in the order of rounds and node indices.
+   Unless all nodes are waiting, the blocked nodes can still make requests in
+   rounds following their blocked request, so only requests from rounds which
+   are not later than the earliest blocked request can be processed. */
+void Network::process_deferred_requests(bool all) {
+	unsigned int i, last_round = 0;
+
+	sort(deferred_requests.begin(), deferred_requests.end(), deferred_request_earlier);
+
+	for (i = 0; i < deferred_requests.size(); i++) {
+		if (!deferred_requests[i].packet) {
+			last_round = deferred_requests[i].round;
+			break;
+		}
+	}
+
+	for (i = 0; i < deferred_requests.size(); i++) {
+		if (!all && deferred_requests[i].round > last_round)
+			break;
+		if (deferred_requests[i].packet) {
+			send_packet(deferred_requests[i].packet);
+		} else {
+			nodes[deferred_requests[i].node]->process_getrefoffsets();
+			assert(blocked_nodes > 0);
+			blocked_nodes--;
 		}
 	}
 
+	deferred_requests.erase(deferred_requests.begin(), deferred_requests.begin() + i);
+}
+
+bool Network::defer_request(unsigned int node) {
+	Deferred_request request;
+
+	if (!deferring_requests)
+		return false;
+
+	request.round = request_rounds[node];
+	request.node = node;
+	request.packet = NULL;
+	deferred_requests.push_back(request);
+	blocked_nodes++;
+
 	return true;
 }
 
+void Network::update_wakeup(unsigned int node) {
+	wakeup_queue.set(node, time + nodes[node]->get_timeout());
+}
+
 void Network::update() {
 	int i, n = nodes.size();
 
@@ -249,33 +764,103 @@ void Network::update() {
 	update_count %= update_rate;
 
 	for (i = 0; i < n; i++) {
+		/* nodes which don't need the update keep their frequency */
+		if (!nodes[i]->needs_update(update_count == 0))
+			continue;
+
 		nodes[i]->get_clock()->update(update_count == 0);
 		nodes[i]->get_refclock()->update(time, nodes[i]->get_clock());
+
+		/* the frequency of the clock may have changed */
+		if (nodes[i]->waiting())
+			update_wakeup(i);
 	}
 
 	update_clock_stats();
 }
 
+/* Get the number of updates before the next packet or wakeup of a node which
+   can be run in a batch if nothing but the clocks needs to be updated every
+   second. The wakeups are predicted from the evolution of the clocks with one
+   second left as a margin for rounding errors. */
+unsigned int Network::get_batchable_updates(Sim_time next_update, Sim_time time_limit) {
+	int i, n = nodes.size();
+	Sim_time end, timeout;
+
+	if (update_rate != 1 || offset_log || freq_log || rawfreq_log)
+		return 0;
+
+	end = time + packet_queue->get_timeout(time);
+	if (end > time_limit)
+		end = time_limit;
+
+	for (i = 0; i < n; i++) {
+		if (!nodes[i]->waiting() || !nodes[i]->get_clock()->can_batch_updates() ||
+				nodes[i]->get_refclock()->needs_updates())
+			return 0;
+
+		timeout = time + nodes[i]->get_timeout_updates(next_update - time);
+		if (end > timeout)
+			end = timeout;
+	}
+
+	end = floor(end - next_update - 1.0);
+	if (end < 1.0)
+		return 0;
+	if (end > 1e6)
+		end = 1e6;
+
+	return end;
+}
+
+/* run the per-second updates of the clocks and their stats in a loop for
+   each node without any other events */
+void Network::batch_updates(Sim_time next_update, unsigned int updates) {
+	int i, n = nodes.size();
+	unsigned int j;
+
+	for (j = 0; j < updates; j++) {
+		time = next_update + j;
+
+		for (i = 0; i < n; i++) {
+			if (nodes[i]->needs_update(true))
+				nodes[i]->get_clock()->update(true);
+		}
+
+		clock_bank.update_stats(time);
+	}
+
+	for (i = 0; i < n; i++)
+		update_wakeup(i);
+}
+
+/* all clocks are advanced and their stats updated at once in the bank */
 void Network::update_clock_stats() {
+	const double *offsets;
 	int i, n = nodes.size();
 
+	offsets = clock_bank.update_stats(time);
+
+#ifdef DEBUG
+	/* check the bank is in sync with the clocks, allowing for a different
+	   rounding of the vectorised loop (e.g. contraction to FMA) */
+	for (i = 0; i < n; i++)
+		assert(fabs(offsets[i] - (double)(nodes[i]->get_clock()->get_real_time() - time)) <=
+				1e-12 * (fabs(time) + 1.0));
+#endif
+
 	if (offset_log) {
 		for (i = 0; i < n; i++)
-			fprintf(offset_log, "%.9f%c", nodes[i]->get_clock()->get_real_time() - time, i + 1 < n ? '\t' : '\n');
+			fprintf(offset_log, "%.9f%c", offsets[i], i + 1 < n ? '\t' : '\n');
 	}
 	if (freq_log) {
 		for (i = 0; i < n; i++)
-			fprintf(freq_log, "%e%c", nodes[i]->get_clock()->get_total_freq() - 1.0, i + 1 < n ? '\t' : '\n');
+			fprintf(freq_log, "%e%c", clock_bank.get_total_freq(i) - 1.0, i + 1 < n ? '\t' : '\n');
 	}
 	if (rawfreq_log) {
 		for (i = 0; i < n; i++)
-			fprintf(rawfreq_log, "%e%c", nodes[i]->get_clock()->get_raw_freq() - 1.0, i + 1 < n ? '\t' : '\n');
+			fprintf(rawfreq_log, "%e%c", clock_bank.get_raw_freq(i) - 1.0, i + 1 < n ? '\t' : '\n');
 	}
-
-	for (i = 0; i < n; i++)
-		stats[i].update_clock_stats(nodes[i]->get_clock()->get_real_time() - time,
-				nodes[i]->get_clock()->get_total_freq() - 1.0,
-				nodes[i]->get_clock()->get_raw_freq() - 1.0);
 }
 
 void Network::open_offset_log(const char *log) {
@@ -295,6 +880,7 @@ void Network::open_packet_log(const char *log) {
 }
 
 void Network::print_stats(int verbosity) const {
+	struct Clock_stats clock_stats;
 	int i, n = nodes.size();
 
 	if (verbosity <= 0)
@@ -303,10 +889,16 @@ void Network::print_stats(int verbosity) const {
 	for (i = 0; i < n; i++) {
 		if (verbosity > 1)
 			printf("\n---------------------- Node %d ----------------------\n\n", i + 1);
-		stats[i].print(verbosity);
+		clock_bank.get_stats(i, &clock_stats);
+		stats[i].print(verbosity, &clock_stats);
 	}
 	if (verbosity == 1)
 		printf("\n");
+
+	if (verbosity > 1) {
+		printf("\n---------------------- Packets ----------------------\n\n");
+		packet_pool.print(verbosity);
+	}
 }
 
 void Network::reset_stats() {
@@ -314,16 +906,40 @@ void Network::reset_stats() {
 
 	for (i = 0; i < n; i++)
 		stats[i].reset();
+	clock_bank.reset_stats(true);
 }
 
 void Network::reset_clock_stats() {
-	int i, n = nodes.size();
+	clock_bank.reset_stats(false);
+}
 
-	for (i = 0; i < n; i++)
-		stats[i].reset_clock_stats();
+struct Packet *Network::alloc_packet(unsigned int len) {
+	return packet_pool.alloc(len);
+}
+
+struct Packet *Network::clone_packet(const struct Packet *packet) {
+	return packet_pool.clone(packet);
+}
+
+void Network::free_packet(struct Packet *packet) {
+	packet_pool.free(packet);
 }
 
 void Network::send(struct Packet *packet) {
+	Deferred_request request;
+
+	if (deferring_requests) {
+		request.round = request_rounds[packet->from];
+		request.node = packet->from;
+		request.packet = packet;
+		deferred_requests.push_back(request);
+		return;
+	}
+
+	send_packet(packet);
+}
+
+void Network::send_packet(struct Packet *packet) {
 	double delay = -1.0;
 	unsigned int i;
 
@@ -335,14 +951,14 @@ void Network::send(struct Packet *packet) {
 			if (i == packet->from)
 				continue;
 
-			p = new struct Packet;
-			memcpy(p, packet, sizeof (struct Packet));
+			/* the copies share the payload */
+			p = clone_packet(packet);
 			p->to = i;
 
-			send(p);
+			send_packet(p);
 		}
 
-		delete packet;
+		free_packet(packet);
 		return;
 	}
 
@@ -352,12 +968,12 @@ void Network::send(struct Packet *packet) {
 	i = packet->from * nodes.size() + packet->to;
 
 	if (link_delays[i]) {
-		link_delay_variables["time"] = time;
-		link_delay_variables["from"] = packet->from + 1;
-		link_delay_variables["to"] = packet->to + 1;
-		link_delay_variables["subnet"] = packet->subnet + 1;
-		link_delay_variables["port"] = packet->dst_port;
-		link_delay_variables["length"] = packet->len;
+		link_delay_variables.values[GENERATOR_VARIABLE_TIME] = time;
+		link_delay_variables.values[GENERATOR_VARIABLE_FROM] = packet->from + 1;
+		link_delay_variables.values[GENERATOR_VARIABLE_TO] = packet->to + 1;
+		link_delay_variables.values[GENERATOR_VARIABLE_SUBNET] = packet->subnet + 1;
+		link_delay_variables.values[GENERATOR_VARIABLE_PORT] = packet->dst_port;
+		link_delay_variables.values[GENERATOR_VARIABLE_LENGTH] = packet->len;
 
 		delay = link_delays[i]->generate(&link_delay_variables);
 	}
@@ -365,7 +981,7 @@ void Network::send(struct Packet *packet) {
 	stats[packet->from].update_packet_stats(false, time, delay);
 
 	if (packet_log)
-		fprintf(packet_log, "%e\t%d\t%d\t%e\t%d\t%d\t%d\n", time,
+		fprintf(packet_log, "%e\t%d\t%d\t%e\t%d\t%d\t%d\n", (double)time,
 				packet->from + 1, packet->to + 1, delay,
 				packet->src_port, packet->dst_port,
 				packet->subnet + 1);
@@ -373,7 +989,7 @@ void Network::send(struct Packet *packet) {
 	if (delay > 0.0) {
 		packet->receive_time = time + delay;
 		packet->delay = delay;
-		packet_queue.insert(packet);
+		packet_queue->insert(packet);
 #ifdef DEBUG
 		printf("sending packet from %d to %d:%d:%d at %f delay %f \n",
 				packet->from, packet->subnet, packet->to,
@@ -385,11 +1001,11 @@ void Network::send(struct Packet *packet) {
 				packet->from, packet->subnet, packet->to,
 				packet->dst_port, time);
 #endif
-		delete packet;
+		free_packet(packet);
 	}
 }
 
-double Network::get_time() const {
+Sim_time Network::get_time() const {
 	return time;
 }
 
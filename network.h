@@ -26,8 +26,15 @@ using namespace std;
 #include "node.h"
 #include "stats.h"
 
+/* payload shared by all copies of a broadcast packet */
+struct Packet_payload {
+	unsigned int references;
+	unsigned int size_class;
+	char data[];
+};
+
 struct Packet {
-	double receive_time;
+	Sim_time receive_time;
 	double delay;
 	int broadcast;
 	unsigned int subnet;
@@ -36,21 +43,106 @@ struct Packet {
 	unsigned int src_port;
 	unsigned int dst_port;
 	unsigned int len;
-	char data[MAX_PACKET_SIZE];
+	char *data;
+	struct Packet_payload *payload;
+};
+
+/* sizes of payload buffers (including the header) are powers of two
+   from 2^PACKET_POOL_MIN_SHIFT */
+#define PACKET_POOL_MIN_SHIFT 6
+#define PACKET_POOL_CLASSES 7
+#define PACKET_POOL_SLAB_SIZE 65536
+
+class Packet_pool {
+	vector<struct Packet *> free_packets;
+	vector<struct Packet_payload *> free_payloads[PACKET_POOL_CLASSES];
+	vector<char *> slabs;
+
+	unsigned long allocations;
+	unsigned long payload_allocations;
+	unsigned long in_use;
+	unsigned long max_in_use;
+	unsigned long allocated_memory;
+
+	static unsigned int get_size_class(unsigned int len);
+	char *alloc_slab(unsigned int size);
+	struct Packet *alloc_header();
+	public:
+	Packet_pool();
+	~Packet_pool();
+	struct Packet *alloc(unsigned int len);
+	struct Packet *clone(const struct Packet *packet);
+	void free(struct Packet *packet);
+	void print(int verbosity) const;
 };
 
 class Packet_queue {
+	public:
+	virtual ~Packet_queue();
+	virtual void insert(struct Packet *packet) = 0;
+	virtual struct Packet *dequeue() = 0;
+	virtual double get_timeout(Sim_time time) const = 0;
+	virtual bool empty() const = 0;
+};
+
+class Packet_queue_list: public Packet_queue {
 	deque<Packet *> queue;
 	public:
-	Packet_queue();
-	~Packet_queue();
-	void insert(struct Packet *packet);
-	struct Packet *dequeue();
-	double get_timeout(double time) const;
+	Packet_queue_list();
+	virtual ~Packet_queue_list();
+	virtual void insert(struct Packet *packet);
+	virtual struct Packet *dequeue();
+	virtual double get_timeout(Sim_time time) const;
+	virtual bool empty() const;
+};
+
+struct Packet_queue_entry {
+	Sim_time receive_time;
+	unsigned long sequence;
+	struct Packet *packet;
+};
+
+class Packet_queue_heap: public Packet_queue {
+	vector<Packet_queue_entry> heap;
+	unsigned long sequence;
+	public:
+	Packet_queue_heap();
+	virtual ~Packet_queue_heap();
+	virtual void insert(struct Packet *packet);
+	virtual struct Packet *dequeue();
+	virtual double get_timeout(Sim_time time) const;
+	virtual bool empty() const;
+};
+
+class Wakeup_queue {
+	vector<unsigned int> heap;
+	vector<Sim_time> times;
+	vector<int> positions;
+
+	bool earlier(unsigned int node1, unsigned int node2) const;
+	void move(unsigned int node, unsigned int position);
+	void sift_up(unsigned int position);
+	void sift_down(unsigned int position);
+	public:
+	Wakeup_queue(unsigned int nodes);
+	~Wakeup_queue();
+	void set(unsigned int node, Sim_time time);
+	void remove(unsigned int node);
+	bool empty() const;
+	unsigned int get_first() const;
+	Sim_time get_first_time() const;
+};
+
+/* request which has to be processed in the same order as if the requests
+   were collected from the nodes in rounds */
+struct Deferred_request {
+	unsigned int round;
+	unsigned int node;
+	struct Packet *packet;
 };
 
 class Network {
-	double time;
+	Sim_time time;
 	unsigned int subnets;
 	unsigned int update_rate;
 	unsigned int update_count;
@@ -62,7 +154,19 @@ class Network {
 	
 	Generator_variables link_delay_variables;
 
-	Packet_queue packet_queue;
+	Packet_pool packet_pool;
+	Packet_queue *packet_queue;
+	Wakeup_queue wakeup_queue;
+	Clock_bank clock_bank;
+
+	int epoll_fd;
+	bool shm_transport;
+	bool batching_updates;
+	bool deferring_requests;
+	unsigned int blocked_nodes;
+	vector<unsigned int> request_rounds;
+	vector<Deferred_request> deferred_requests;
+	vector<struct epoll_event> epoll_events;
 
 	FILE *offset_log;
 	FILE *freq_log;
@@ -70,15 +174,27 @@ class Network {
 	FILE *packet_log;
 
 	void update();
+	unsigned int get_batchable_updates(Sim_time next_update, Sim_time time_limit);
+	void batch_updates(Sim_time next_update, unsigned int updates);
 	void update_clock_stats();
+	void update_wakeup(unsigned int node);
+	bool collect_requests(vector<unsigned int> &awake);
+	bool collect_requests_epoll(vector<unsigned int> &awake);
+	void process_deferred_requests(bool all);
+	void send_packet(struct Packet *packet);
 
 	public:
 	Network(const char *socket, unsigned int n, unsigned int s, unsigned int rate);
 	~Network();
 	bool prepare_clients();
 	Node *get_node(unsigned int node);
+	Clock_bank *get_clock_bank();
 	void set_link_delay_generator(unsigned int from, unsigned int to, Generator *generator);
-	bool run(double time_limit);
+	void set_packet_queue(Packet_queue *queue);
+	void set_epoll(bool enable);
+	void set_shm_transport(bool enable);
+	void set_update_batching(bool enable);
+	bool run(Sim_time time_limit);
 	void open_offset_log(const char *log);
 	void open_freq_log(const char *log);
 	void open_rawfreq_log(const char *log);
@@ -87,8 +203,12 @@ class Network {
 	void reset_stats();
 	void reset_clock_stats();
 
+	struct Packet *alloc_packet(unsigned int len);
+	struct Packet *clone_packet(const struct Packet *packet);
+	void free_packet(struct Packet *packet);
 	void send(struct Packet *packet);
-	double get_time() const;
+	bool defer_request(unsigned int node);
+	Sim_time get_time() const;
 	unsigned int get_subnets() const;
 };
 
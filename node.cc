@@ -20,18 +20,41 @@
 #include "protocol.h"
 #include "sysheaders.h"
 
-Node::Node(int index, Network *network) {
+/* create shared memory which will be passed to the client in the reply to
+   its registration, return NULL on failure */
+static void *create_shm(size_t size, int *fd) {
+	void *shm;
+
+	*fd = memfd_create("clknetsim", MFD_CLOEXEC);
+	if (*fd < 0)
+		return NULL;
+
+	if (ftruncate(*fd, size) < 0 ||
+			(shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0)) == MAP_FAILED) {
+		close(*fd);
+		*fd = -1;
+		return NULL;
+	}
+
+	return shm;
+}
+
+Node::Node(int index, Network *network): clock(network->get_clock_bank(), index) {
 	this->network = network;
 	this->index = index;
 	fd = -1;
+	transport_fd = -1;
+	transport = NULL;
+	time_page = (struct Time_page *)create_shm(sizeof (*time_page), &time_page_fd);
 	pending_request = REQ_REGISTER;
 	start_time = 0.0;
 	terminate = false;
+	filter_ports = false;
 }
 
 Node::~Node() {
 	while (!incoming_packets.empty()) {
-		delete incoming_packets.back();
+		network->free_packet(incoming_packets.back());
 		incoming_packets.pop_back();
 	}
 
@@ -42,6 +65,14 @@ Node::~Node() {
 			resume();
 	} while (process_fd());
 
+	if (transport)
+		munmap(transport, sizeof (*transport));
+	if (transport_fd >= 0)
+		close(transport_fd);
+	if (time_page)
+		munmap(time_page, sizeof (*time_page));
+	if (time_page_fd >= 0)
+		close(time_page_fd);
 	if (fd >= 0)
 		close(fd);
 }
@@ -54,7 +85,78 @@ int Node::get_fd() const {
 	return fd;
 }
 
-void Node::set_start_time(double time) {
+/* use shared memory for requests and replies */
+bool Node::enable_shm_transport() {
+	transport = (struct Transport_shm *)create_shm(sizeof (*transport), &transport_fd);
+	return transport != NULL;
+}
+
+bool Node::connected() const {
+	char c;
+	int r;
+
+	r = recv(fd, &c, sizeof (c), MSG_PEEK | MSG_DONTWAIT);
+
+	return r > 0 || (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/* send the reply with descriptors of the shared memory, the transport
+   first and the time page second */
+int Node::send_shm_fds(void *data, int len) {
+	char cmsgbuf[CMSG_SPACE(2 * sizeof (int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int sent, fds[2], n = 0;
+
+	if (transport_fd >= 0)
+		fds[n++] = transport_fd;
+	if (time_page_fd >= 0)
+		fds[n++] = time_page_fd;
+
+	if (!n)
+		return send(fd, data, len, 0);
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof (msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = CMSG_SPACE(n * sizeof (int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(n * sizeof (int));
+	memcpy(CMSG_DATA(cmsg), fds, n * sizeof (int));
+
+	sent = sendmsg(fd, &msg, 0);
+
+	if (transport_fd >= 0)
+		close(transport_fd);
+	if (time_page_fd >= 0)
+		close(time_page_fd);
+	transport_fd = time_page_fd = -1;
+
+	return sent;
+}
+
+void Node::update_time_page() {
+	if (!time_page)
+		return;
+
+	__atomic_store_n(&time_page->sequence, time_page->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	time_page->real_time = clock.get_real_time();
+	time_page->monotonic_time = clock.get_monotonic_time();
+	time_page->network_time = network->get_time();
+
+	__atomic_store_n(&time_page->sequence, time_page->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void Node::set_start_time(Sim_time time) {
 	start_time = time;
 }
 
@@ -62,10 +164,19 @@ bool Node::process_fd() {
 	Request_packet request;
 	int received, reqlen;
 
-	received = recv(fd, &request, sizeof (request), 0);
+	if (transport && pending_request != REQ_REGISTER) {
+		while ((received = transport_read(&transport->requests, &request,
+						sizeof (request), terminate ? 1 : 1000)) < 0) {
+			if (!connected())
+				return false;
+		}
+	} else
+		received = recv(fd, &request, sizeof (request), 0);
 	if (received < (int)sizeof (request.header))
 		return false;
 
+	update_clock();
+
 	reqlen = received - (int)offsetof(Request_packet, data);
 
 	assert(pending_request == 0);
@@ -73,7 +184,7 @@ bool Node::process_fd() {
 
 #ifdef DEBUG
 	printf("received request %ld in node %d at %f\n",
-			pending_request, index, clock.get_real_time());
+			pending_request, index, (double)clock.get_real_time());
 #endif
 
 	switch (pending_request) {
@@ -115,11 +226,17 @@ bool Node::process_fd() {
 			break;
 		case REQ_GETREFOFFSETS:
 			assert(reqlen == 0);
-			process_getrefoffsets();
+			if (!network->defer_request(index))
+				process_getrefoffsets();
 			break;
 		case REQ_DEREGISTER:
 			assert(reqlen == 0);
 			break;
+		case REQ_SETPORTS:
+			assert(reqlen == sizeof (Request_setports));
+			assert(request.data.setports.num <= REQUEST_SETPORTS_SIZE);
+			process_setports(&request.data.setports);
+			break;
 		default:
 			assert(0);
 	}
@@ -134,7 +251,12 @@ void Node::reply(void *data, int len, int request) {
 	pending_request = 0;
 
 	if (data) {
-		sent = send(fd, data, len, 0);
+		if (transport && request != REQ_REGISTER)
+			sent = transport_write(&transport->replies, data, len, 1000) ? len : 0;
+		else if (request == REQ_REGISTER)
+			sent = send_shm_fds(data, len);
+		else
+			sent = send(fd, data, len, 0);
 		assert(sent == len);
 	}
 }
@@ -151,14 +273,18 @@ void Node::process_gettime() {
 
 void Node::process_settime(Request_settime *req) {
 	clock.set_time(req->time);
+	update_time_page();
 	reply(NULL, 0, REQ_SETTIME);
 }
 
 void Node::process_adjtimex(Request_adjtimex *req) {
 	Reply_adjtimex rep;
 	struct timex *buf = &req->timex;
+	bool step = buf->modes & ADJ_SETOFFSET;
 
 	rep.ret = clock.adjtimex(buf);
+	if (step)
+		update_time_page();
 	rep.timex = *buf;
 	rep._pad = 0;
 	reply(&rep, sizeof (rep), REQ_ADJTIMEX);
@@ -172,19 +298,24 @@ void Node::process_adjtime(Request_adjtime *req) {
 }
 
 void Node::try_select() {
-	Reply_select rep = {-1, 0, 0};
+	Reply_select rep;
+	int len = offsetof(Reply_select, packet);
+
+	rep.ret = -1;
+	rep.subnet = 0;
+	rep.dst_port = 0;
 
 	if (terminate) {
 		rep.ret = REPLY_SELECT_TERMINATE;
 #ifdef DEBUG
 		printf("select returned on termination in %d at %f\n",
-				index, clock.get_real_time());
+				index, (double)clock.get_real_time());
 #endif
 	} else if (select_timeout - clock.get_monotonic_time() <= 0.0) {
 		assert(select_timeout - clock.get_monotonic_time() > -1e-10);
 		rep.ret = REPLY_SELECT_TIMEOUT;
 #ifdef DEBUG
-		printf("select returned on timeout in %d at %f\n", index, clock.get_real_time());
+		printf("select returned on timeout in %d at %f\n", index, (double)clock.get_real_time());
 #endif
 	} else if (select_read && incoming_packets.size() > 0) {
 		rep.ret = incoming_packets.back()->broadcast ?
@@ -193,7 +324,7 @@ void Node::try_select() {
 		rep.subnet = incoming_packets.back()->subnet;
 		rep.dst_port = incoming_packets.back()->dst_port;
 #ifdef DEBUG
-		printf("select returned for packet in %d at %f\n", index, clock.get_real_time());
+		printf("select returned for packet in %d at %f\n", index, (double)clock.get_real_time());
 #endif
 	}
 
@@ -201,7 +332,14 @@ void Node::try_select() {
 		rep.time.real_time = clock.get_real_time();
 		rep.time.monotonic_time = clock.get_monotonic_time();
 		rep.time.network_time = network->get_time();
-		reply(&rep, sizeof (rep), REQ_SELECT);
+		update_time_page();
+
+		/* save the client a REQ_RECV request */
+		if (select_packet && (rep.ret == REPLY_SELECT_NORMAL ||
+					rep.ret == REPLY_SELECT_BROADCAST))
+			len += get_packet(&rep.packet);
+
+		reply(&rep, len, REQ_SELECT);
 	}
 }
 
@@ -210,9 +348,10 @@ void Node::process_select(Request_select *req) {
 		req->timeout = 0.0;
 	select_timeout = clock.get_monotonic_time() + req->timeout;
 	select_read = req->read;
+	select_packet = req->packet;
 #ifdef DEBUG
 	printf("select called with timeout %f read %d in %d at %f\n",
-			req->timeout, req->read, index, clock.get_real_time());
+			req->timeout, req->read, index, (double)clock.get_real_time());
 #endif
 	try_select();
 }
@@ -221,14 +360,13 @@ void Node::process_send(Request_send *req) {
 	struct Packet *packet;
 
 	if (!terminate) {
-		packet = new struct Packet;
+		packet = network->alloc_packet(req->len);
 		packet->broadcast = req->to == (unsigned int)-1;
 		packet->subnet = req->subnet;
 		packet->from = index;
 		packet->to = req->to;
 		packet->src_port = req->src_port;
 		packet->dst_port = req->dst_port;
-		packet->len = req->len;
 		memcpy(packet->data, req->data, req->len);
 		network->send(packet);
 	}
@@ -238,50 +376,89 @@ void Node::process_send(Request_send *req) {
 
 void Node::process_recv() {
 	Reply_recv rep;
+	int len;
+
+	len = get_packet(&rep);
+	reply(&rep, len, REQ_RECV);
+}
+
+/* fill the reply with the oldest incoming packet and remove it, return
+   the length of the reply */
+int Node::get_packet(Reply_recv *rep) {
 	struct Packet *packet;
 
 	if (incoming_packets.empty()) {
-		rep.subnet = 0;
-		rep.from = -1;
-		rep.src_port = 0;
-		rep.dst_port = 0;
-		rep.len = 0;
-		reply(&rep, offsetof (Reply_recv, data), REQ_RECV);
+		rep->subnet = 0;
+		rep->from = -1;
+		rep->src_port = 0;
+		rep->dst_port = 0;
+		rep->len = 0;
 
-		return;
+		return offsetof (Reply_recv, data);
 	}
 
 	packet = incoming_packets.back();
 
-	rep.subnet = packet->subnet;
-	rep.from = packet->from;
-	rep.src_port = packet->src_port;
-	rep.dst_port = packet->dst_port;
-	rep.len = packet->len;
+	rep->subnet = packet->subnet;
+	rep->from = packet->from;
+	rep->src_port = packet->src_port;
+	rep->dst_port = packet->dst_port;
+	rep->len = packet->len;
 
-	assert(packet->len <= sizeof (rep.data));
-	memcpy(rep.data, packet->data, packet->len);
+	assert(packet->len <= sizeof (rep->data));
+	memcpy(rep->data, packet->data, packet->len);
 	
-	delete packet;
-
-	reply(&rep, offsetof (Reply_recv, data) + rep.len, REQ_RECV);
-
+	network->free_packet(packet);
 	incoming_packets.pop_back();
 #ifdef DEBUG
-	printf("received packet in %d at %f\n", index, clock.get_real_time());
+	printf("received packet in %d at %f\n", index, (double)clock.get_real_time());
 #endif
+
+	return offsetof (Reply_recv, data) + rep->len;
 }
 
-void Node::receive(struct Packet *packet) {
+/* return false if the packet was dropped as no socket could receive it */
+bool Node::receive(struct Packet *packet) {
+	update_clock();
+
 	if (pending_request == REQ_REGISTER || pending_request == REQ_DEREGISTER) {
-		delete packet;
-		return;
+		network->free_packet(packet);
+		return true;
+	}
+
+	if (!accepts_packet(packet)) {
+		network->free_packet(packet);
+		return false;
 	}
 
 	incoming_packets.insert(incoming_packets.begin(), packet);
 
 	if (pending_request == REQ_SELECT)
 		try_select();
+
+	return true;
+}
+
+bool Node::accepts_packet(const struct Packet *packet) const {
+	unsigned int i;
+
+	/* clients which don't send their ports get all packets */
+	if (!filter_ports)
+		return true;
+
+	for (i = 0; i < ports.num; i++) {
+		if ((ports.subnets[i] < 0 || ports.subnets[i] == (int)packet->subnet) &&
+				(!packet->dst_port || ports.ports[i] == packet->dst_port))
+			return true;
+	}
+
+	return false;
+}
+
+void Node::process_setports(Request_setports *req) {
+	ports = *req;
+	filter_ports = true;
+	reply(NULL, 0, REQ_SETPORTS);
 }
 
 void Node::process_getrefsample() {
@@ -301,6 +478,8 @@ void Node::process_getrefoffsets() {
 }
 
 void Node::resume() {
+	update_clock();
+
 	switch (pending_request) {
 		case REQ_SELECT:
 			try_select();
@@ -309,9 +488,12 @@ void Node::resume() {
 			if (start_time - network->get_time() <= 0.0 || terminate) {
 				Reply_register rep;
 				rep.subnets = network->get_subnets();
+				rep.transport = transport ? TRANSPORT_SHM : TRANSPORT_SOCKET;
+				rep.time_page = time_page != NULL;
+				update_time_page();
 				reply(&rep, sizeof (rep), REQ_REGISTER);
 #ifdef DEBUG
-				printf("starting %d at %f\n", index, network->get_time());
+				printf("starting %d at %f\n", index, (double)network->get_time());
 #endif
 			}
 			break;
@@ -333,9 +515,10 @@ bool Node::finished() const {
 	return pending_request == REQ_DEREGISTER;
 }
 
-double Node::get_timeout() const {
+double Node::get_timeout() {
 	switch (pending_request) {
 		case REQ_SELECT:
+			update_clock();
 			return clock.get_true_interval(select_timeout - clock.get_monotonic_time());
 		case REQ_REGISTER:
 			return start_time - network->get_time();
@@ -346,10 +529,32 @@ double Node::get_timeout() const {
 	}
 }
 
+/* timeout assuming the clock will be updated in the update interval and then
+   every second */
+double Node::get_timeout_updates(double update_interval) {
+	if (pending_request != REQ_SELECT)
+		return get_timeout();
+
+	update_clock();
+	return clock.get_true_interval_updates(select_timeout - clock.get_monotonic_time(),
+			update_interval);
+}
+
+/* the clock is advanced only when the node is accessed */
+void Node::update_clock() {
+	clock.advance(network->get_time());
+}
+
 Clock *Node::get_clock() {
+	update_clock();
 	return &clock;
 }
 
+/* check if the clock or refclock needs to be updated at the next tick */
+bool Node::needs_update(bool second) const {
+	return clock.needs_update(second) || refclock.needs_updates();
+}
+
 Refclock *Node::get_refclock() {
 	return &refclock;
 }
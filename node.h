@@ -19,6 +19,7 @@
 #define NODE_H
 
 #include "protocol.h"
+#include "transport.h"
 #include "clock.h"
 
 #include <vector>
@@ -33,20 +34,33 @@ class Node {
 	Network *network;
 	int index;
 	int fd;
+	int transport_fd;
+	struct Transport_shm *transport;
+	int time_page_fd;
+	struct Time_page *time_page;
 	int pending_request;
-	double start_time;
-	double select_timeout;
+	Sim_time start_time;
+	Sim_time select_timeout;
 	bool select_read;
+	bool select_packet;
 	bool terminate;
+	bool filter_ports;
+	Request_setports ports;
 
 	vector<struct Packet *> incoming_packets;
 
+	void update_clock();
+	bool connected() const;
+	int send_shm_fds(void *data, int len);
+	void update_time_page();
+	int get_packet(Reply_recv *rep);
 	public:
 	Node(int index, Network *network);
 	~Node();
 	void set_fd(int fd);
 	int get_fd() const;
-	void set_start_time(double time);
+	bool enable_shm_transport();
+	void set_start_time(Sim_time time);
 	bool process_fd();
 	void reply(void *data, int len, int request);
 	void process_gettime();
@@ -59,14 +73,18 @@ class Node {
 	void process_recv();
 	void process_getrefsample();
 	void process_getrefoffsets();
+	void process_setports(Request_setports *req);
+	bool accepts_packet(const struct Packet *packet) const;
 
-	void receive(struct Packet *packet);
+	bool receive(struct Packet *packet);
 	void resume();
 	bool waiting() const;
 	bool finished() const;
 
-	double get_timeout() const;
+	double get_timeout();
+	double get_timeout_updates(double update_interval);
 	Clock *get_clock();
+	bool needs_update(bool second) const;
 	Refclock *get_refclock();
 };
 
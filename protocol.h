@@ -31,6 +31,7 @@
 #define REQ_GETREFSAMPLE 9
 #define REQ_GETREFOFFSETS 10
 #define REQ_DEREGISTER 11
+#define REQ_SETPORTS 12
 
 struct Request_header {
 	int request;
@@ -39,10 +40,13 @@ struct Request_header {
 
 struct Request_register {
 	unsigned int node;
+	unsigned int transport; /* requested transport */
 };
 
 struct Reply_register {
 	unsigned int subnets;
+	unsigned int transport; /* accepted transport */
+	unsigned int time_page; /* time page passed with the reply */
 };
 
 struct Reply_gettime {
@@ -51,6 +55,16 @@ struct Reply_gettime {
 	double network_time;
 };
 
+/* page shared with the client, updated by the server before the client is
+   resumed and when its clock is set, so it doesn't need REQ_GETTIME */
+struct Time_page {
+	unsigned int sequence; /* odd while updating */
+	unsigned int _pad;
+	double real_time;
+	double monotonic_time;
+	double network_time;
+};
+
 struct Request_settime {
 	double time;
 };
@@ -76,7 +90,7 @@ struct Reply_adjtime {
 struct Request_select {
 	double timeout;
 	int read;
-	int _pad;
+	int packet; /* return the received packet in the reply */
 };
 
 #define REPLY_SELECT_TIMEOUT 0
@@ -84,13 +98,6 @@ struct Request_select {
 #define REPLY_SELECT_BROADCAST 2
 #define REPLY_SELECT_TERMINATE 3
 
-struct Reply_select {
-	int ret;
-	unsigned int subnet; /* for NORMAL or BROADCAST */
-	unsigned int dst_port; /* for NORMAL or BROADCAST */
-	struct Reply_gettime time;
-};
-
 #define MAX_PACKET_SIZE 4000
 
 struct Request_send {
@@ -111,6 +118,14 @@ struct Reply_recv {
 	char data[MAX_PACKET_SIZE];
 };
 
+struct Reply_select {
+	int ret;
+	unsigned int subnet; /* for NORMAL or BROADCAST */
+	unsigned int dst_port; /* for NORMAL or BROADCAST */
+	struct Reply_gettime time;
+	struct Reply_recv packet; /* for NORMAL or BROADCAST if requested */
+};
+
 struct Reply_getrefsample {
 	double time;
 	double offset;
@@ -124,6 +139,16 @@ struct Reply_getrefoffsets {
 	double offsets[REPLY_GETREFOFFSETS_SIZE];
 };
 
+#define REQUEST_SETPORTS_SIZE 32
+
+/* ports of sockets which can receive packets, subnet -1 is any subnet */
+struct Request_setports {
+	unsigned int num;
+	unsigned int _pad;
+	unsigned int ports[REQUEST_SETPORTS_SIZE];
+	int subnets[REQUEST_SETPORTS_SIZE];
+};
+
 union Request_data {
 	struct Request_register _register;
 	struct Request_settime settime;
@@ -131,6 +156,7 @@ union Request_data {
 	struct Request_adjtime adjtime;
 	struct Request_select select;
 	struct Request_send send;
+	struct Request_setports setports;
 };
 
 union Reply_data {
@@ -95,15 +95,61 @@ bool load_config(const char *file, Network *network, unsigned int nodes) {
 void run_generator(char *expr, int num) {
 	Generator_generator gen_generator;
 	Generator *generator;
+	double values[GENERATOR_BLOCK_SIZE];
+	int i, n;
 
 	generator = gen_generator.generate(expr);
-	while (num--)
-		printf("%.9e\n", generator->generate(NULL));
+	while (num > 0) {
+		n = num < GENERATOR_BLOCK_SIZE ? num : GENERATOR_BLOCK_SIZE;
+		generator->generate_n(NULL, values, n);
+		for (i = 0; i < n; i++)
+			printf("%.9e\n", values[i]);
+		num -= n;
+	}
 	delete generator;
 }
 
+/* measure how fast the expression can be evaluated, one by one and in
+   blocks */
+void benchmark_generator(char *expr, int num) {
+	Generator_generator gen_generator;
+	Generator *generator;
+	struct timespec ts1, ts2;
+	double values[GENERATOR_BLOCK_SIZE], sum, elapsed;
+	char *code;
+	int i, j, block;
+
+	for (block = 0; block < 2; block++) {
+		/* the parser modifies the expression */
+		code = strdup(expr);
+		generator = gen_generator.generate(code);
+		free(code);
+		sum = 0.0;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts1);
+		if (block) {
+			for (i = 0; i < num; i += GENERATOR_BLOCK_SIZE) {
+				generator->generate_n(NULL, values, GENERATOR_BLOCK_SIZE);
+				for (j = 0; j < GENERATOR_BLOCK_SIZE && i + j < num; j++)
+					sum += values[j];
+			}
+		} else {
+			for (i = 0; i < num; i++)
+				sum += generator->generate(NULL);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts2);
+
+		elapsed = ts2.tv_sec - ts1.tv_sec + (ts2.tv_nsec - ts1.tv_nsec) / 1e9;
+		printf("%s: %d numbers in %.3f seconds, %.2f ns per number, mean %.6e\n",
+				block ? "blocks" : "single", num, elapsed, elapsed / num * 1e9, sum / num);
+
+		delete generator;
+	}
+}
+
 int main(int argc, char **argv) {
-	int nodes, subnets = 1, help = 0, verbosity = 2, generate_only = 0, rate = 1;
+	int nodes, subnets = 1, help = 0, verbosity = 2, generate_only = 0, rate = 1, list_queue = 0, epoll = 0, shm = 0;
+	int benchmark = 0, ziggurat = 1, producer = 0, batch_updates = 0;
 	double limit = 10000.0, reset = 0.0;
 	const char *offset_log = NULL, *freq_log = NULL, *rawfreq_log = NULL,
 	      *packet_log = NULL, *config, *socket = "clknetsim.sock", *env;
@@ -112,7 +158,7 @@ int main(int argc, char **argv) {
 	int r, opt;
 	Network *network;
 
-	while ((opt = getopt(argc, argv, "l:r:R:n:o:f:Gg:p:s:v:h")) != -1) {
+	while ((opt = getopt(argc, argv, "l:r:R:n:o:f:beGg:mPp:q:s:tuv:h")) != -1) {
 		switch (opt) {
 			case 'l':
 				limit = atof(optarg);
@@ -126,6 +172,15 @@ int main(int argc, char **argv) {
 			case 'n':
 				subnets = atoi(optarg);
 				break;
+			case 'b':
+				benchmark = 1;
+				break;
+			case 'e':
+				epoll = 1;
+				break;
+			case 'm':
+				shm = 1;
+				break;
 			case 'o':
 				offset_log = optarg;
 				break;
@@ -138,15 +193,30 @@ int main(int argc, char **argv) {
 			case 'p':
 				packet_log = optarg;
 				break;
+			case 'q':
+				if (strcmp(optarg, "list") == 0)
+					list_queue = 1;
+				else if (strcmp(optarg, "heap") != 0)
+					help = 1;
+				break;
 			case 's':
 				socket = optarg;
 				break;
+			case 't':
+				producer = 1;
+				break;
+			case 'u':
+				batch_updates = 1;
+				break;
 			case 'G':
 				generate_only = 1;
 				break;
 			case 'v':
 				verbosity = atoi(optarg);
 				break;
+			case 'P':
+				ziggurat = 0;
+				break;
 			case 'h':
 			default:
 				help = 1;
@@ -155,18 +225,27 @@ int main(int argc, char **argv) {
 
 	if (optind + 2 != argc || help) {
 		printf("usage: clknetsim [options] config nodes\n");
-		printf("   or: clknetsim -G expr num\n");
+		printf("   or: clknetsim [-b] [-t] [-P] -G expr num\n");
 		printf("       -l secs       set time limit to secs (default 10000)\n");
 		printf("       -r secs       reset clock stats after secs (default 0)\n");
 		printf("       -R rate       set freq/log/stats update rate (default 1 per second)\n");
 		printf("       -n subnets    set number of subnetworks (default 1)\n");
+		printf("       -e            process requests in the order they arrive (epoll)\n");
+		printf("       -m            exchange requests with clients in shared memory\n");
 		printf("       -o file       log time offsets to file\n");
 		printf("       -f file       log frequency offsets to file\n");
 		printf("       -g file       log raw (w/o slew) frequency offsets to file\n");
 		printf("       -p file       log packet delays to file\n");
+		printf("       -q queue      set packet queue (heap or list, default heap)\n");
 		printf("       -s socket     set server socket name (default clknetsim.sock)\n");
+		printf("       -t            generate random numbers in a separate thread\n");
+		printf("       -u            batch per-second clock updates between events (without\n");
+		printf("                     logs and freq/step/refclock generators and with rate 1)\n");
 		printf("       -v level      set verbosity level (default 2)\n");
+		printf("       -P            use the polar method and logarithm instead of ziggurat\n");
+		printf("                     for normal and exponential distributions\n");
 		printf("       -G            print num numbers generated by expr\n");
+		printf("       -b            measure speed of expr instead of printing numbers\n");
 		printf("       -h            print usage\n");
 		return 1;
 	}
@@ -176,18 +255,34 @@ int main(int argc, char **argv) {
 
 	env = getenv("CLKNETSIM_RANDOM_SEED");
 	if (env) {
-		srandom(atoi(env));
+		Generator_random_stream::set_seed(atoi(env));
 	} else {
 		gettimeofday(&tv, NULL);
-		srandom(tv.tv_sec ^ tv.tv_usec);
+		Generator_random_stream::set_seed(tv.tv_sec ^ tv.tv_usec);
 	}
 
+	Generator_random_stream::set_ziggurat(ziggurat);
+	if (producer)
+		Generator_random_stream::set_producer(true);
+
 	if (generate_only) {
-		run_generator(argv[optind], nodes);
+		if (benchmark)
+			benchmark_generator(argv[optind], nodes);
+		else
+			run_generator(argv[optind], nodes);
 		return 0;
 	}
 
 	network = new Network(socket, nodes, subnets, rate);
+
+	if (list_queue)
+		network->set_packet_queue(new Packet_queue_list());
+	if (epoll)
+		network->set_epoll(true);
+	if (shm)
+		network->set_shm_transport(true);
+	if (batch_updates)
+		network->set_update_batching(true);
 	
 	if (offset_log)
 		network->open_offset_log(offset_log);
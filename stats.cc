@@ -27,8 +27,6 @@ Stats::~Stats() {
 }
 
 void Stats::reset() {
-	reset_clock_stats();
-
 	packets_in_sum2 = 0.0;
 	packets_out_sum2 = 0.0;
 	packets_in = 0;
@@ -40,50 +38,12 @@ void Stats::reset() {
 	packets_in_int_min = 0.0;
 	packets_out_int_min = 0.0;
 
-	wakeups_int_sum = 0;
-	wakeups = 0;
-}
-
-void Stats::reset_clock_stats() {
-	offset_sum2 = 0.0;
-	offset_abs_sum = 0.0;
-	offset_sum = 0.0;
-	offset_abs_max = 0.0;
-	freq_sum2 = 0.0;
-	freq_abs_sum = 0.0;
-	freq_sum = 0.0;
-	freq_abs_max = 0.0;
-	rawfreq_sum2 = 0.0;
-	rawfreq_abs_sum = 0.0;
-	rawfreq_sum = 0.0;
-	rawfreq_abs_max = 0.0;
-	samples = 0;
-}
-
-void Stats::update_clock_stats(double offset, double freq, double rawfreq) {
-	offset_sum2 += offset * offset;
-	offset_abs_sum += fabs(offset);
-	offset_sum += offset;
-	if (offset_abs_max < fabs(offset))
-		offset_abs_max = fabs(offset);
+	packets_filtered = 0;
 
-	freq_sum2 += freq * freq;
-	freq_abs_sum += fabs(freq);
-	freq_sum += freq;
-	if (freq_abs_max < fabs(freq))
-		freq_abs_max = fabs(freq);
-
-	rawfreq_sum2 += rawfreq * rawfreq;
-	rawfreq_abs_sum += fabs(rawfreq);
-	rawfreq_sum += rawfreq;
-	if (rawfreq_abs_max < fabs(rawfreq))
-		rawfreq_abs_max = fabs(rawfreq);
-
-	samples++;
-	wakeups_int_sum++;
+	wakeups = 0;
 }
 
-void Stats::update_packet_stats(bool incoming, double time, double delay) {
+void Stats::update_packet_stats(bool incoming, Sim_time time, double delay) {
 	if (delay < 0.0)
 		delay = 0.0;
 	if (incoming) {
@@ -107,30 +67,36 @@ void Stats::update_packet_stats(bool incoming, double time, double delay) {
 	}
 }
 
+void Stats::update_filtered_packet_stats() {
+	packets_filtered++;
+}
+
 void Stats::update_wakeup_stats() {
 	wakeups++;
 }
 
-void Stats::print(int verbosity) const {
+void Stats::print(int verbosity, const struct Clock_stats *clock_stats) const {
+	unsigned long samples = clock_stats->samples;
+
 	if (verbosity <= 0)
 		return;
 	if (verbosity <= 1) {
-		printf("%e ", sqrt(offset_sum2 / samples));
+		printf("%e ", sqrt(clock_stats->offset_sum2 / samples));
 		return;
 	}
 
-	printf("RMS offset:                            \t%e\n", sqrt(offset_sum2 / samples));
-	printf("Maximum absolute offset:               \t%e\n", offset_abs_max);
-	printf("Mean absolute offset:                  \t%e\n", offset_abs_sum / samples);
-	printf("Mean offset:                           \t%e\n", offset_sum / samples);
-	printf("RMS frequency:                         \t%e\n", sqrt(freq_sum2 / samples));
-	printf("Maximum absolute frequency:            \t%e\n", freq_abs_max);
-	printf("Mean absolute frequency:               \t%e\n", freq_abs_sum / samples);
-	printf("Mean frequency:                        \t%e\n", freq_sum / samples);
-	printf("RMS raw frequency:                     \t%e\n", sqrt(rawfreq_sum2 / samples));
-	printf("Maximum absolute raw frequency:        \t%e\n", rawfreq_abs_max);
-	printf("Mean absolute raw frequency:           \t%e\n", rawfreq_abs_sum / samples);
-	printf("Mean raw frequency:                    \t%e\n", rawfreq_sum / samples);
+	printf("RMS offset:                            \t%e\n", sqrt(clock_stats->offset_sum2 / samples));
+	printf("Maximum absolute offset:               \t%e\n", clock_stats->offset_abs_max);
+	printf("Mean absolute offset:                  \t%e\n", clock_stats->offset_abs_sum / samples);
+	printf("Mean offset:                           \t%e\n", clock_stats->offset_sum / samples);
+	printf("RMS frequency:                         \t%e\n", sqrt(clock_stats->freq_sum2 / samples));
+	printf("Maximum absolute frequency:            \t%e\n", clock_stats->freq_abs_max);
+	printf("Mean absolute frequency:               \t%e\n", clock_stats->freq_abs_sum / samples);
+	printf("Mean frequency:                        \t%e\n", clock_stats->freq_sum / samples);
+	printf("RMS raw frequency:                     \t%e\n", sqrt(clock_stats->rawfreq_sum2 / samples));
+	printf("Maximum absolute raw frequency:        \t%e\n", clock_stats->rawfreq_abs_max);
+	printf("Mean absolute raw frequency:           \t%e\n", clock_stats->rawfreq_abs_sum / samples);
+	printf("Mean raw frequency:                    \t%e\n", clock_stats->rawfreq_sum / samples);
 	if (packets_in) {
 		printf("RMS incoming packet delay:             \t%e\n", (double)sqrt(packets_in_sum2 / packets_in));
 	} else {
@@ -155,8 +121,9 @@ void Stats::print(int verbosity) const {
 		printf("Mean outgoing packet interval:         \tinf\n");
 		printf("Minimum outgoing packet interval:      \tinf\n");
 	}
+	printf("Filtered incoming packets:             \t%lu\n", packets_filtered);
 	if (wakeups)
-		printf("Mean wakeup interval:                  \t%e\n", (double)wakeups_int_sum / wakeups);
+		printf("Mean wakeup interval:                  \t%e\n", (double)clock_stats->updates / wakeups);
 	else
 		printf("Mean wakeup interval:                  \tinf\n");
 }
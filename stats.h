@@ -20,44 +20,32 @@
 
 #include "clock.h"
 
+/* stats of the packets and wakeups of a node, the stats of its clock are
+   collected in the clock bank */
 class Stats {
-	double offset_sum2;
-	double offset_abs_sum;
-	double offset_sum;
-	double offset_abs_max;
-	double freq_sum2;
-	double freq_abs_sum;
-	double freq_sum;
-	double freq_abs_max;
-	double rawfreq_sum2;
-	double rawfreq_abs_sum;
-	double rawfreq_sum;
-	double rawfreq_abs_max;
-	unsigned long samples;
-
 	double packets_in_sum2;
 	double packets_out_sum2;
 	unsigned long packets_in;
 	unsigned long packets_out;
-	double packets_in_time_last;
-	double packets_out_time_last;
+	Sim_time packets_in_time_last;
+	Sim_time packets_out_time_last;
 	double packets_in_int_sum;
 	double packets_out_int_sum;
 	double packets_in_int_min;
 	double packets_out_int_min;
 
-	unsigned long wakeups_int_sum;
+	unsigned long packets_filtered;
+
 	unsigned long wakeups;
 
 	public:
 	Stats();
 	~Stats();
 	void reset();
-	void reset_clock_stats();
-	void update_clock_stats(double offset, double freq, double rawfreq);
-	void update_packet_stats(bool incoming, double time, double delay);
+	void update_packet_stats(bool incoming, Sim_time time, double delay);
+	void update_filtered_packet_stats();
 	void update_wakeup_stats();
-	void print(int verbosity) const;
+	void print(int verbosity, const struct Clock_stats *clock_stats) const;
 };
 
 #endif
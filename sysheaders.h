@@ -6,12 +6,16 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <errno.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/timex.h>
 #include <assert.h>
 #include <math.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifdef __linux__
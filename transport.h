@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2010  Miroslav Lichvar <mlichvar@redhat.com>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Shared-memory transport between the clients and the server. Each client
+   has a ring for requests and a ring for replies. The consumer of a ring
+   spins for a while when it's empty and then sleeps on a futex, which is
+   woken up by the producer. The functions return 0 or -1 on timeout, so the
+   caller can check if the other side is still connected. */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "futex.h"
+
+#define TRANSPORT_SOCKET 0
+#define TRANSPORT_SHM 1
+
+#define TRANSPORT_RING_SIZE 65536
+
+struct Transport_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t head_waiting;
+	uint32_t tail_waiting;
+	char data[TRANSPORT_RING_SIZE];
+};
+
+struct Transport_shm {
+	struct Transport_ring requests;
+	struct Transport_ring replies;
+};
+
+static inline void transport_copy_in(struct Transport_ring *ring, uint32_t pos, const void *buf, uint32_t len) {
+	uint32_t i = pos % TRANSPORT_RING_SIZE, l = TRANSPORT_RING_SIZE - i;
+
+	if (l > len)
+		l = len;
+	memcpy(ring->data + i, buf, l);
+	memcpy(ring->data, (const char *)buf + l, len - l);
+}
+
+static inline void transport_copy_out(const struct Transport_ring *ring, uint32_t pos, void *buf, uint32_t len) {
+	uint32_t i = pos % TRANSPORT_RING_SIZE, l = TRANSPORT_RING_SIZE - i;
+
+	if (l > len)
+		l = len;
+	memcpy(buf, ring->data + i, l);
+	memcpy((char *)buf + l, ring->data, len - l);
+}
+
+/* write a message to the ring, return 0 on timeout */
+static inline int transport_write(struct Transport_ring *ring, const void *buf, uint32_t len, int timeout) {
+	uint32_t head = ring->head, tail;
+
+	assert(sizeof (len) + len <= TRANSPORT_RING_SIZE);
+
+	while (head - (tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) +
+			sizeof (len) + len > TRANSPORT_RING_SIZE) {
+		if (!futex_wait(&ring->tail, &ring->tail_waiting, tail, timeout))
+			return 0;
+	}
+
+	transport_copy_in(ring, head, &len, sizeof (len));
+	transport_copy_in(ring, head + sizeof (len), buf, len);
+	__atomic_store_n(&ring->head, head + sizeof (len) + len, __ATOMIC_SEQ_CST);
+	futex_wake(&ring->head, &ring->head_waiting);
+
+	return 1;
+}
+
+/* read a message from the ring, return its (truncated) length or -1 on
+   timeout */
+static inline int transport_read(struct Transport_ring *ring, void *buf, uint32_t maxlen, int timeout) {
+	uint32_t tail = ring->tail, len;
+
+	while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+		if (!futex_wait(&ring->head, &ring->head_waiting, tail, timeout))
+			return -1;
+	}
+
+	transport_copy_out(ring, tail, &len, sizeof (len));
+	transport_copy_out(ring, tail + sizeof (len), buf, len < maxlen ? len : maxlen);
+	__atomic_store_n(&ring->tail, tail + sizeof (len) + len, __ATOMIC_SEQ_CST);
+	futex_wake(&ring->tail, &ring->tail_waiting);
+
+	return len < maxlen ? len : maxlen;
+}
+
+#endif